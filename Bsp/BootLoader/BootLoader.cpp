@@ -1,5 +1,36 @@
 #include "Bootloader.h"
 
+static uint32_t uidWord(uint8_t index)
+{
+    switch (index) {
+    case 0:
+        return HAL_GetUIDw0();
+    case 1:
+        return HAL_GetUIDw1();
+    default:
+        return HAL_GetUIDw2();
+    }
+}
+
+// Commands that erase, program or retune the bus; over a shared address they need a host session
+static bool isDestructive(uint8_t cmd)
+{
+    switch (cmd) {
+    case 0x01: // Erase
+    case 0x02: // Start write
+    case 0x03: // Write word
+    case 0x04: // End write
+    case 0x06: // Start stream
+    case 0x07: // Stream data
+    case 0x0B: // Seek
+    case 0x0E: // Write at
+    case 0x23: // Bit rate
+        return true;
+    default:
+        return false;
+    }
+}
+
 void Bootloader::sendConfirm(uint8_t id, uint8_t status)
 {
     uint8_t msg[3];
@@ -23,24 +54,246 @@ void Bootloader::sendCRC(uint8_t id, uint32_t crc)
     can_.send(can_id, msg, 4);
 }
 
-void Bootloader::processCanCmd(uint8_t id, uint8_t cmd, uint8_t *data, uint8_t len)
+void Bootloader::sendStreamAck(uint8_t id, uint8_t status)
+{
+    uint8_t msg[5];
+    msg[0] = status;
+    msg[1] = flashIndex_ & 0xFF;         // Cumulative write offset, 24-bit little endian
+    msg[2] = (flashIndex_ >> 8) & 0xFF;
+    msg[3] = (flashIndex_ >> 16) & 0xFF;
+    msg[4] = streamWindow_;              // Negotiated frames per ACK
+
+    uint16_t can_id = ((uint16_t)id << 7) | 0x13;
+    can_.send(can_id, msg, 5);
+}
+
+void Bootloader::sendDiagnostics(uint8_t id)
+{
+    uint32_t overruns = can_.rxOverruns();
+    if (overruns > 0xFFFF) overruns = 0xFFFF;
+    uint32_t drops = can_.txDrops();
+    if (drops > 0xFFFF) drops = 0xFFFF;
+
+    uint8_t msg[7];
+    msg[0] = overruns & 0xFF;               // RX ring overruns, 16-bit little endian (saturating)
+    msg[1] = (overruns >> 8) & 0xFF;
+    msg[2] = can_.rxHighWater() & 0xFF;     // RX ring high-water mark
+    msg[3] = drops & 0xFF;                  // TX frames dropped on a full queue (saturating)
+    msg[4] = (drops >> 8) & 0xFF;
+    msg[5] = can_.txHighWater() & 0xFF;     // TX queue high-water mark
+    msg[6] = can_.txPending() & 0xFF;       // TX frames currently queued
+
+    uint16_t can_id = ((uint16_t)id << 7) | 0x14;
+    can_.send(can_id, msg, 7);
+}
+
+void Bootloader::sendEraseProgress(uint8_t id)
+{
+    uint8_t msg[4];
+    msg[0] = (uint8_t)flash_.eraseState(); // 0 idle, 1 running, 2 done, 3 failed
+    msg[1] = flash_.eraseDone() & 0xFF;    // Sectors/pages erased so far
+    msg[2] = flash_.eraseTotal() & 0xFF;   // Sectors/pages to erase
+    msg[3] = flash_.eraseSkipped() & 0xFF; // Of those, found blank and skipped
+
+    uint16_t can_id = ((uint16_t)id << 7) | 0x15;
+    can_.send(can_id, msg, 4);
+}
+
+void Bootloader::sendUnitHash(uint8_t id, uint32_t index)
+{
+    uint32_t start = 0, size = 0;
+    if (!flash_.appUnitRange(index, start, size)) {
+        return;
+    }
+
+    uint32_t crc = flash_.getCRC(start, size);
+
+    uint8_t msg[7];
+    msg[0] = index & 0xFF;
+    msg[1] = (crc >> 24) & 0xFF; // Same byte order as the CRC reply
+    msg[2] = (crc >> 16) & 0xFF;
+    msg[3] = (crc >> 8) & 0xFF;
+    msg[4] = crc & 0xFF;
+    msg[5] = (size >> 10) & 0xFF; // Sector size in KB, little endian
+    msg[6] = (size >> 18) & 0xFF;
+
+    uint16_t can_id = ((uint16_t)id << 7) | 0x16;
+    can_.send(can_id, msg, 7);
+}
+
+void Bootloader::sendAppStatus(uint8_t id)
+{
+    AppStatus status = flash_.appStatus();
+
+    uint8_t msg[2];
+    msg[0] = (status == AppStatus::Valid) ? 0xFF : 0x00;
+    msg[1] = (uint8_t)status; // Reason code
+
+    uint16_t can_id = ((uint16_t)id << 7) | 0x17;
+    can_.send(can_id, msg, 2);
+}
+
+void Bootloader::sendProgramStats(uint8_t id)
+{
+    uint32_t cycles = flash_.programCycles();
+    uint32_t words = flash_.programWords();
+
+    uint8_t msg[8];
+    msg[0] = cycles & 0xFF;          // CPU cycles spent programming since begin write, 32-bit little endian
+    msg[1] = (cycles >> 8) & 0xFF;
+    msg[2] = (cycles >> 16) & 0xFF;
+    msg[3] = (cycles >> 24) & 0xFF;
+    msg[4] = words & 0xFF;           // Words programmed, 24-bit little endian
+    msg[5] = (words >> 8) & 0xFF;
+    msg[6] = (words >> 16) & 0xFF;
+    msg[7] = FLASH_PROGRAM_ENGINE;   // 0 HAL, 1 RAM routine
+
+    uint16_t can_id = ((uint16_t)id << 7) | 0x18;
+    can_.send(can_id, msg, 8);
+}
+
+void Bootloader::sendWriteAck(uint8_t id, uint8_t status, uint32_t offset)
+{
+    uint8_t msg[4];
+    msg[0] = status;
+    msg[1] = offset & 0xFF;         // Offset of the word, 24-bit little endian
+    msg[2] = (offset >> 8) & 0xFF;
+    msg[3] = (offset >> 16) & 0xFF;
+
+    uint16_t can_id = ((uint16_t)id << 7) | 0x19;
+    can_.send(can_id, msg, 4);
+}
+
+void Bootloader::sendResumePoint(uint8_t id, uint16_t imageId)
+{
+    uint32_t length = 0, committed = 0;
+    bool found = flash_.resumePoint(imageId, length, committed);
+
+    uint8_t msg[8];
+    msg[0] = found ? 0xFF : 0x00;
+    msg[1] = committed & 0xFF;         // Last committed offset, 24-bit little endian
+    msg[2] = (committed >> 8) & 0xFF;
+    msg[3] = (committed >> 16) & 0xFF;
+    msg[4] = length & 0xFF;            // Journaled image length, 32-bit little endian
+    msg[5] = (length >> 8) & 0xFF;
+    msg[6] = (length >> 16) & 0xFF;
+    msg[7] = (length >> 24) & 0xFF;
+
+    uint16_t can_id = ((uint16_t)id << 7) | 0x1A;
+    can_.send(can_id, msg, 8);
+}
+
+// Up to two missing block ranges per frame; a range with count 0 ends the report
+void Bootloader::sendMissingRanges(uint8_t id)
+{
+    uint8_t msg[8] = {};
+
+    for (uint8_t i = 0; i < 8 && missingActive_; i += 4) {
+        uint32_t first = missingNext_, count = 0;
+        if (!flash_.missingRange(first, count, missingEnd_)) {
+            missingActive_ = false; // Terminator, the zeroed pair
+            break;
+        }
+        if (count > 0xFFFF) count = 0xFFFF;
+
+        msg[i] = first & 0xFF;             // First missing block, 16-bit little endian
+        msg[i + 1] = (first >> 8) & 0xFF;
+        msg[i + 2] = count & 0xFF;         // Missing blocks in a row, 16-bit little endian
+        msg[i + 3] = (count >> 8) & 0xFF;
+        missingNext_ = first + count;
+    }
+
+    uint16_t can_id = ((uint16_t)id << 7) | 0x1B;
+    can_.send(can_id, msg, 8);
+}
+
+// Every matching node sends this very frame, so simultaneous answers merge on the bus
+void Bootloader::sendScanReply()
+{
+    uint16_t can_id = ((uint16_t)BROADCAST_ID << 7) | 0x1C;
+    can_.send(can_id, nullptr, 0);
+}
+
+void Bootloader::sendUid(uint8_t id)
 {
-    lastCmdTick_ = HAL_GetTick(); // Reset timeout when command received
+    uint8_t uid[UID_WORDS * 4];
+    for (uint8_t i = 0; i < sizeof(uid); i++) {
+        uid[i] = (uidWord(i / 4) >> (8 * (i % 4))) & 0xFF;
+    }
+
+    uint8_t msg[8];
+    msg[0] = 0;                        // Part 0: UID bytes 0..6
+    for (uint8_t i = 0; i < 7; i++) {
+        msg[i + 1] = uid[i];
+    }
+    uint16_t can_id = ((uint16_t)id << 7) | 0x1D;
+    can_.send(can_id, msg, 8);
 
+    msg[0] = 1;                        // Part 1: UID bytes 7..11, addressed flag
+    for (uint8_t i = 0; i < 5; i++) {
+        msg[i + 1] = uid[i + 7];
+    }
+    msg[6] = addressed_ ? 0xFF : 0x00;
+    msg[7] = 0;
+    can_.send(can_id, msg, 8);
+}
+
+// Replies already queued go out at the old rate; the new one is kept only once a frame arrives on it
+void Bootloader::switchBitRate(uint8_t index, uint32_t timeoutMs)
+{
+    can_.drainTx(CAN_DRAIN_MS);
+    if (!can_.setBitRate(index)) {
+        return;
+    }
+
+    rateProbation_ = (index != 0);
+    rateTick_ = HAL_GetTick();
+    rateTimeout_ = timeoutMs;
+}
+
+void Bootloader::processCanCmd(uint8_t dest, uint8_t cmd, uint8_t *data, uint8_t len)
+{
+    // Replies always carry our own address, also for broadcast and group commands
+    uint8_t id = (uint8_t)can_.nodeId();
+
+    // Replies of other nodes reach us through a shared address (the factory NODE_ID, or the
+    // fastscan replies on BROADCAST_ID); they must not keep us in the bootloader
+    if (cmd >= 0x11 && cmd <= 0x1F) {
+        return;
+    }
+
+    // Foreign frames can fall into the broadcast and group ranges; there nothing is erased or written
+    // until a host has opened a session with a unicast command
+    bool unicast = (dest == id);
+    if (!unicast && !hostSession_ && isDestructive(cmd)) {
+        return;
+    }
+
+    bool known = true;
     switch (cmd) {
-    case 0x01: // Erase flash
+    case 0x01: // Erase flash, data[0]: 0x01 erase on demand while writing, 0x02 erase in background,
+               //             0x03 erase only application sector data[1]
         if (loaderMode_) {
-            if (flash_.eraseApplication()) {
+            EraseMode mode = EraseMode::Full;
+            if (len >= 1 && data[0] == 0x01) mode = EraseMode::OnDemand;
+            if (len >= 1 && data[0] == 0x02) mode = EraseMode::Background;
+
+            bool ok = (len >= 2 && data[0] == 0x03) ? flash_.eraseAppUnit(data[1]) : flash_.eraseApplication(mode);
+            if (ok) {
                 sendConfirm(id, 0xFF);
             } else {
                 sendConfirm(id, 0x00);
             }
         }
         break;
-    case 0x02: // Start flash write
+    case 0x02: // Start flash write, optional data[0..3] = image length (bounds the missing ranges report)
         if (loaderMode_) {
-            if (flash_.beginWrite()) {
+            uint32_t length = (len >= 4) ? (data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24)) : 0;
+            if (flash_.beginWrite(0, length)) {
+                fec_.reset();
                 flashInProgress_ = true;
+                streaming_ = false;
+                compressed_ = false;
                 flashIndex_ = 0;
                 sendConfirm(id, 0xFF);
             } else {
@@ -60,13 +313,31 @@ void Bootloader::processCanCmd(uint8_t id, uint8_t cmd, uint8_t *data, uint8_t l
             }
         }
         break;
-    case 0x04: // End flash write
+    case 0x04: // End flash write, optional data[0..3] = total image length, data[4..7] = expected CRC
         if (loaderMode_ && flashInProgress_) {
-            if (flash_.endWrite()) {
+            uint32_t length = (len >= 4) ? (data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24)) : 0;
+
+            // A compressed image may end in the middle of a word; without it the image is truncated
+            uint32_t tail;
+            bool tailOk = true;
+            if (streaming_ && compressed_ && lzss_.flush(tail)) {
+                tailOk = flash_.stageWords(&tail, 1);
+            }
+
+            if (tailOk && flash_.endWrite(length)) {
                 flashInProgress_ = false;
-                uint32_t crc = flash_.getAppCRC();
-                flash_.writeCRC(crc);
-                sendConfirm(id, 0xFF);
+                streaming_ = false;
+                compressed_ = false;
+                uint32_t crc = flash_.getWrittenCRC();
+                uint32_t expected = (len >= 8) ? (data[4] | (data[5] << 8) | (data[6] << 16) | (data[7] << 24)) : crc;
+
+                // A mismatching image never gets a CRC and so never becomes valid
+                if (crc == expected && flash_.writeCRC(crc)) {
+                    sendConfirm(id, 0xFF);
+                } else {
+                    sendConfirm(id, 0x00);
+                }
+                sendCRC(id, crc);
             } else {
                 sendConfirm(id, 0x00);
             }
@@ -78,17 +349,262 @@ void Bootloader::processCanCmd(uint8_t id, uint8_t cmd, uint8_t *data, uint8_t l
             sendCRC(id, crc);
         }
         break;
+    case 0x06: // Start stream write, data[0] = proposed frames per ACK, data[1] = flags (bit 0 resume, bit 1 compressed),
+               // data[2..3] = image ID (16-bit little endian, 0 = not journaled), data[4..7] = image length
+        if (loaderMode_) {
+            uint8_t flags = (len >= 2) ? data[1] : 0;
+            uint16_t imageId = (len >= 4) ? (data[2] | (data[3] << 8)) : 0;
+            uint32_t length = (len >= 8) ? (data[4] | (data[5] << 8) | (data[6] << 16) | (data[7] << 24)) : 0;
+            bool started = (flags & 0x01) ? flash_.resumeWrite(imageId, length) : flash_.beginWrite(imageId, length);
+
+            if (started) {
+                uint8_t window = (len >= 1 && data[0] != 0) ? data[0] : sessionWindow_;
+                if (window > STREAM_MAX_WINDOW) window = STREAM_MAX_WINDOW;
+
+                // A compressed stream starts a fresh window, also at a resume offset
+                compressed_ = (flags & 0x02) != 0;
+                if (compressed_) {
+                    lzss_.reset();
+                }
+
+                flashInProgress_ = true;
+                streaming_ = true;
+                streamWindow_ = window;
+                streamCount_ = 0;
+                ackPending_ = false;
+                flashIndex_ = flash_.writeOffset(); // Non-zero when resuming
+                sendStreamAck(id, 0xFF);
+            } else {
+                sendStreamAck(id, 0x00);
+            }
+        }
+        break;
+    case 0x07: // Stream data, one or two words per frame, or 1..8 bytes of LZSS data
+        if (loaderMode_ && flashInProgress_ && streaming_ && len >= (compressed_ ? 1 : 4)) {
+            uint32_t words[LZSS_MAX_FRAME_WORDS];
+            uint32_t count = 0;
+            if (compressed_) {
+                count = lzss_.decode(data, len, words);
+            } else {
+                for (uint8_t i = 0; i + 4 <= len && i < 8; i += 4) {
+                    words[count++] = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16) | (data[i + 3] << 24);
+                }
+            }
+
+            // Frames only fill RAM here, run() programs full buffers while the next window arrives
+            bool ok = flash_.stageWords(words, count);
+            flashIndex_ = flash_.stagedOffset();
+
+            if (!ok) {
+                // Report the last accepted offset at once so the host can resend from there;
+                // the decoder lost the frame, so a compressed stream has to be started again
+                streamCount_ = 0;
+                ackPending_ = false;
+                streaming_ = !compressed_;
+                sendStreamAck(id, 0x00);
+            } else if (++streamCount_ >= streamWindow_) {
+                streamCount_ = 0;
+                if (flash_.stageSpace() >= windowWords()) {
+                    sendStreamAck(id, 0xFF);
+                } else {
+                    ackPending_ = true;
+                }
+            }
+        }
+        break;
+    case 0x08: // Request diagnostics
+        sendDiagnostics(id);
+        break;
+    case 0x09: // Request erase progress
+        sendEraseProgress(id);
+        break;
+    case 0x0A: // Request sector hashes, data[0] = first sector, data[1] = count (0 = all)
+        if (loaderMode_) {
+            uint32_t total = flash_.appUnitCount();
+            hashNext_ = (len >= 1) ? data[0] : 0;
+            hashEnd_ = (len >= 2 && data[1] != 0) ? hashNext_ + data[1] : total;
+            if (hashEnd_ > total) hashEnd_ = total;
+        }
+        break;
+    case 0x0B: // Seek, data[0..2] = write offset (24-bit little endian)
+        if (loaderMode_ && flashInProgress_ && len >= 3) {
+            uint32_t offset = data[0] | (data[1] << 8) | (data[2] << 16);
+            if (flash_.seek(offset)) {
+                flashIndex_ = offset;
+                streamCount_ = 0;
+                ackPending_ = false;
+                sendStreamAck(id, 0xFF);
+            } else {
+                sendStreamAck(id, 0x00);
+            }
+        }
+        break;
+    case 0x0C: // Request application status
+        sendAppStatus(id);
+        break;
+    case 0x0D: // Request programming statistics
+        sendProgramStats(id);
+        break;
+    case 0x0E: // Write at, data[0..2] = offset (24-bit little endian), data[3..6] = word
+        if (loaderMode_ && flashInProgress_ && len >= 7) {
+            uint32_t offset = data[0] | (data[1] << 8) | (data[2] << 16);
+            uint32_t word = data[3] | (data[4] << 8) | (data[5] << 16) | (data[6] << 24);
+            sendWriteAck(id, flash_.writeAt(offset, word) ? 0xFF : 0x00, offset);
+        }
+        break;
+    case 0x0F: // Resume query, data[0..1] = image ID (16-bit little endian)
+        if (loaderMode_ && len >= 2) {
+            sendResumePoint(id, data[0] | (data[1] << 8));
+        }
+        break;
+    case 0x10: // Request missing ranges, data[0..1] = first block, data[2..3] = block count (0 = to the image end)
+        if (loaderMode_) {
+            // An explicit count may reach past the highest write, e.g. when the last frames of a multicast were lost
+            uint32_t count = (len >= 4) ? (data[2] | (data[3] << 8)) : 0;
+            missingNext_ = (len >= 2) ? (data[0] | (data[1] << 8)) : 0;
+            missingEnd_ = (count != 0) ? missingNext_ + count : flash_.blockCount();
+            if (missingEnd_ > FlashInterface::MAX_BLOCKS) missingEnd_ = FlashInterface::MAX_BLOCKS;
+            missingActive_ = true;
+        }
+        break;
+    case 0x20: // Fastscan, data[0] = bit checked (0..31) or FASTSCAN_START, data[1] = UID word,
+               //           data[2..5] = UID word value (32-bit little endian), data[6] = next UID word
+        if (loaderMode_ && len >= 2 && data[0] == FASTSCAN_START) {
+            // data[1] bit 0: nodes that already run on a stored ID take part as well
+            selected_ = false;
+            scanWord_ = (!addressed_ || (data[1] & 0x01)) ? 0 : FASTSCAN_IDLE;
+            if (scanWord_ == 0) {
+                sendScanReply();
+            }
+        } else if (loaderMode_ && len >= 7 && data[0] < 32 && data[1] == scanWord_) {
+            // Answer if the UID word matches the value from the top bit down to the checked bit;
+            // a full match moves on to the next word, past the last one the node is selected
+            uint32_t value = data[2] | (data[3] << 8) | (data[4] << 16) | (data[5] << 24);
+            uint32_t mask = 0xFFFFFFFF << data[0];
+            if (((uidWord(scanWord_) ^ value) & mask) == 0) {
+                if (data[0] == 0) {
+                    scanWord_ = data[6] < UID_WORDS ? data[6] : FASTSCAN_IDLE;
+                    selected_ = (data[6] >= UID_WORDS);
+                }
+                sendScanReply();
+            }
+        }
+        break;
+    case 0x21: // Assign node ID data[0], broadcast to the node selected by fastscan, or unicast once addressed
+        // Unaddressed nodes all share the factory NODE_ID, a unicast would give every one of them the same ID
+        if (loaderMode_ && len >= 1 && (selected_ || (addressed_ && dest == id))) {
+            uint8_t nodeId = data[0];
+            bool ok = nodeId != BROADCAST_ID && nodeId != GROUP_ID && nodeId <= 0x0F && flash_.storeNodeId(nodeId);
+            if (ok) {
+                can_.setNodeId(nodeId);
+                id = nodeId;
+                addressed_ = true;
+                selected_ = false;
+            }
+            sendConfirm(id, ok ? 0xFF : 0x00);
+        }
+        break;
+    case 0x22: // Request unique ID, the node selected by fastscan or unicast once addressed
+        if (loaderMode_ && (selected_ || (addressed_ && dest == id))) {
+            sendUid(id);
+        }
+        break;
+    case 0x23: // Switch bit rate to table index data[0] (0 = default), data[1..2] = fallback timeout in ms
+        if (loaderMode_ && len >= 1) {
+            bool ok = can_.bitRateValid(data[0]);
+            sendConfirm(id, ok ? 0xFF : 0x00);
+            if (ok) {
+                uint32_t timeout = (len >= 3) ? (data[1] | (data[2] << 8)) : 0;
+                switchBitRate(data[0], timeout != 0 ? timeout : CAN_FALLBACK_MS);
+            }
+        }
+        break;
+    default:
+        known = false;
+        break;
+    }
+
+    // Only a recognised command from a host talking to us keeps the node in the bootloader;
+    // unknown codes and unrelated traffic in the shared ranges leave the listen window running
+    if (known && (unicast || hostSession_)) {
+        hostSession_ = true;
+        session_ = true; // Stop using the short listen window
+        lastCmdTick_ = HAL_GetTick();
+    }
+}
+
+// Extended ID layout: (address << 25) | (cmd << 18) | index, where the index locates the frame in the
+// image. Every node of a group programs the same frames; nothing is acknowledged per frame, nodes
+// report gaps afterwards through the missing ranges query.
+void Bootloader::processDataFrame(uint8_t dest, uint8_t cmd, uint32_t index, uint8_t *data, uint8_t len)
+{
+    uint8_t id = (uint8_t)can_.nodeId();
+
+    // Every data frame programs flash, see processCanCmd()
+    bool unicast = (dest == id);
+    if (!unicast && !hostSession_) {
+        return;
+    }
+
+    bool known = true;
+    switch (cmd) {
+    case 0x07: // Data at offset index * 8, one or two words
+        if (loaderMode_ && flashInProgress_ && len >= 4) {
+            uint32_t offset = index * 8;
+            bool ok = true;
+            for (uint8_t i = 0; ok && i + 4 <= len && i < 8; i += 4) {
+                uint32_t word = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16) | (data[i + 3] << 24);
+                ok = flash_.writeAt(offset + i, word);
+            }
+
+            // Only a unicast sender hears about a failure right away
+            if (!ok && dest == id) {
+                sendWriteAck(id, 0x00, offset);
+            }
+        }
+        break;
+    case 0x09: // Coded symbol, index = generation << 6 | symbol (0..31 source, 32..63 repair)
+        if (loaderMode_ && flashInProgress_ && len == FEC_SYMBOL_SIZE) {
+            uint32_t generation = index >> 6;
+            if (!fec_.onSymbol(generation, index & 0x3F, data) && dest == id) {
+                sendWriteAck(id, 0x00, generation * FEC_SYMBOLS * FEC_SYMBOL_SIZE);
+            }
+        }
+        break;
     default:
+        known = false;
         break;
     }
+
+    if (known) {
+        hostSession_ = true;
+        session_ = true;
+        lastCmdTick_ = HAL_GetTick();
+    }
 }
 
 // Bootloader main loop
-void Bootloader::run()
+void Bootloader::run(const BootMailbox *request)
 {
-    const uint32_t timeout_ms = 1000; // Jump to APP after 1 seconds without command
+    // Jump after a short listen window unless the application asked us to stay
+    session_ = (request != nullptr);
+    if (request) {
+        // Session pre-negotiated by the application, the host talks at the requested bit rate right away
+        if (request->window != 0) {
+            sessionWindow_ = request->window > STREAM_MAX_WINDOW ? STREAM_MAX_WINDOW : request->window;
+        }
+        sessionBitrate_ = request->bitrate;
+    }
+    if (sessionBitrate_ != 0 && can_.bitRateValid(sessionBitrate_)) {
+        switchBitRate(sessionBitrate_, BOOT_SESSION_MS); // The host needs a moment after the reset
+    }
+    uint8_t storedId;
+    addressed_ = flash_.storedNodeId(storedId);
     lastCmdTick_ = (uint32_t)HAL_GetTick();
 
+    // Evaluate the stored image once, later checks use the cached verdict
+    flash_.appStatus();
+
     uint32_t lastLedTick = HAL_GetTick();
     Led led_1(1);
     Led led_2(2);
@@ -96,8 +612,71 @@ void Bootloader::run()
     led_2.turnOff();
 
     while (1) {
+        CanFrame frame;
+        while (can_.peek(frame)) {
+            // A compressed data frame stays queued until staging has room for its worst case output
+            if (streaming_ && flashInProgress_ && compressed_ && !frame.extended && (frame.id & 0x7F) == 0x07 &&
+                flash_.stageSpace() < LZSS_MAX_FRAME_WORDS) {
+                break;
+            }
+            can_.receive(frame);
+            rateProbation_ = false;
+            if (frame.extended) {
+                processDataFrame(frame.id >> 25, (frame.id >> 18) & 0x7F, frame.id & 0x3FFFF, frame.data, frame.len);
+            } else {
+                processCanCmd(frame.id >> 7, frame.id & 0x7F, frame.data, frame.len);
+            }
+        }
+
         uint32_t now = HAL_GetTick();
 
+        // Back to the default bit rate if the host never showed up at the new one
+        if (rateProbation_ && (uint32_t)(now - rateTick_) > rateTimeout_) {
+            rateProbation_ = false;
+            can_.setBitRate(0);
+        }
+
+        // Program staged stream data a chunk at a time, then release a held-back ACK
+        if (streaming_ && flashInProgress_) {
+            if (!flash_.serviceStage()) {
+                // Staged data was dropped, resend from the last programmed word
+                flashIndex_ = flash_.writeOffset();
+                streamCount_ = 0;
+                ackPending_ = false;
+                streaming_ = !compressed_;
+                sendStreamAck((uint8_t)can_.nodeId(), 0x00);
+            } else if (ackPending_ && flash_.stageSpace() >= windowWords()) {
+                ackPending_ = false;
+                sendStreamAck((uint8_t)can_.nodeId(), 0xFF);
+            }
+        }
+
+        // Background erase: start the next sector and report each completed one
+        EraseState eraseState = flash_.serviceErase();
+        if (eraseState != reportedEraseState_ || flash_.eraseDone() != reportedEraseDone_) {
+            reportedEraseState_ = eraseState;
+            reportedEraseDone_ = flash_.eraseDone();
+            if (eraseState != EraseState::Idle) {
+                sendEraseProgress((uint8_t)can_.nodeId());
+            }
+        }
+        if (eraseState == EraseState::Running) {
+            lastCmdTick_ = now; // Never leave the bootloader halfway through an erase
+        }
+
+        // Sector hashes go out one per pass, without overflowing the TX queue
+        if (hashNext_ < hashEnd_ && can_.txPending() < CAN_TX_QUEUE_SIZE / 2) {
+            sendUnitHash((uint8_t)can_.nodeId(), hashNext_++);
+            lastCmdTick_ = now;
+        }
+
+        // Missing ranges go out the same way, terminated by an empty range
+        if (missingActive_ && can_.txPending() < CAN_TX_QUEUE_SIZE / 2) {
+            sendMissingRanges((uint8_t)can_.nodeId());
+            lastCmdTick_ = now;
+        }
+
+        uint32_t timeout_ms = session_ ? BOOT_SESSION_MS : BOOT_LISTEN_MS;
         if ((uint32_t)(now - lastCmdTick_) > timeout_ms) {
             if (flash_.isAppValid()) {
                 uint32_t appStack = *(uint32_t *)APP_START_ADDRESS;
@@ -134,8 +713,18 @@ void Bootloader::run()
                 // System reset if jump fails
                 NVIC_SystemReset();
             } else {
-                // Application invalid, reset timeout and continue waiting
+                // Application invalid, reset timeout and continue waiting; the host is gone, so
+                // shared-address commands wait for the next unicast again
                 lastCmdTick_ = now;
+                session_ = true;
+                hostSession_ = false;
+
+                // Also after frames did arrive at a switched rate: a host that died mid-transfer
+                // comes back at the default one, e.g. to resume
+                if (can_.bitRate() != 0) {
+                    rateProbation_ = false;
+                    can_.setBitRate(0);
+                }
             }
         }
 
@@ -145,6 +734,9 @@ void Bootloader::run()
             led_2.Toggle();
         }
 
-        HAL_Delay(1);
+        // Sleep until the next CAN frame or SysTick
+        if (!can_.rxPending() && !flash_.stageBusy()) {
+            __WFI();
+        }
     }
 }
\ No newline at end of file
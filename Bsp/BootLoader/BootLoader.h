@@ -2,6 +2,10 @@
 #include "FlashInterface.h"
 #include "CanInterface.h"
 #include "Led.h"
+#include "BootRequest.h"
+#include "FlashProgram.h"
+#include "Fec.h"
+#include "Lzss.h"
 
 #if defined(STM32F412Cx)
 /*
@@ -15,11 +19,20 @@ Flash Memory Layout (STM32F412, 1 MB Flash)
              |                   | <- Application Code Region
              |   Application     |    (736KB)
              |                   |
-0x080BFFFC ──+-------------------+
-             | App Length (4B)   | <- Application Length Storage at APP_END_ADDRESS - 4
 0x080C0000 ──+-------------------+
-             | CRC (4B)          | <- CRC Storage
-0x080C0004 ──+-------------------+
+             | App Length (4B)   | <- Metadata sector 10, erased by every erase mode
+             | CRC (4B)          | <- CRC Storage at 0x080C0004
+             | Verified (4B)     | <- Fast boot marker and header CRC
+             | Header CRC (4B)   |
+0x080C0010 ──+-------------------+
+             | Boot Tally (4KB)  | <- One word zeroed per boot
+0x080C1010 ──+-------------------+
+             | Reserved          |
+0x080C2000 ──+-------------------+
+             | Journal (120KB)   | <- Transfer progress, erased with the metadata
+0x080E0000 ──+-------------------+
+             | Node Log (128KB)  | <- Assigned node ID, sector 11
+0x08100000 ──+-------------------+
 */
 
 #define RAM_START  0x20000000U   // SRAM Start
@@ -29,6 +42,16 @@ Flash Memory Layout (STM32F412, 1 MB Flash)
 #define APP_START_ADDRESS 0x08008000 // Application start address
 #define APP_END_ADDRESS   0x080C0000 // Application code end address
 #define CRC_ADDRESS       0x080C0004 // CRC storage address
+#define BOOT_TALLY_WORDS  1024       // Boots counted before every boot is a full check
+
+#define JOURNAL_ADDRESS  0x080C2000   // Transfer progress journal, behind the boot tally
+#define JOURNAL_SIZE     (120 * 1024)
+#define JOURNAL_UNIT     10           // Metadata sector, a wrap only happens before the length is written
+#define JOURNAL_INTERVAL 4096         // Committed offset granularity in bytes
+
+#define NODE_LOG_ADDRESS 0x080E0000   // Assigned node ID, never erased by an update
+#define NODE_LOG_SIZE    (128 * 1024)
+#define NODE_LOG_UNIT    11
 
 #elif defined(STM32F103xB)
 /*
@@ -38,11 +61,18 @@ Flash Memory Layout (STM32F103CBT6, 128 KB Flash)
              | Bootloader Code   | <- 32KB (0x8000)
 0x08008000 ──+-------------------+
              |   Application     | <- 60KB (0xF000)
-             +-------------------+
-             | App Length (4B)   | <- Application Length Storage at APP_END_ADDRESS - 4
 0x08017000 ──+-------------------+
-             | CRC (4B)          | <- CRC Storage
-0x08017004 ──+-------------------+
+             | App Length (4B)   | <- Metadata page 92, erased by every erase mode
+             | CRC (4B)          | <- CRC Storage at 0x08017004
+             | Verified (4B)     | <- Fast boot marker and header CRC
+             | Header CRC (4B)   |
+0x08017010 ──+-------------------+
+             | Boot Tally        | <- One word zeroed per boot, rest of the page
+0x08017400 ──+-------------------+
+             | Journal (1KB)     | <- Transfer progress, page 93
+0x08017800 ──+-------------------+
+             | Node Log (1KB)    | <- Assigned node ID, page 94
+0x08017C00 ──+-------------------+
              | Reserved          |
 0x08020000 ──+-------------------+
 */
@@ -56,18 +86,67 @@ Flash Memory Layout (STM32F103CBT6, 128 KB Flash)
 #define APP_START_ADDRESS 0x08008000                     // Application start
 #define APP_END_ADDRESS   (APP_START_ADDRESS + APP_SIZE)
 #define CRC_ADDRESS       (APP_END_ADDRESS + 4)
+#define BOOT_TALLY_WORDS  252 // Rest of the 1KB metadata page
+
+#define JOURNAL_ADDRESS  0x08017400 // Transfer progress journal
+#define JOURNAL_SIZE     1024
+#define JOURNAL_UNIT     93         // Page holding the journal
+#define JOURNAL_INTERVAL 1024       // Committed offset granularity, one page
+
+#define NODE_LOG_ADDRESS 0x08017800 // Assigned node ID, never erased by an update
+#define NODE_LOG_SIZE    1024
+#define NODE_LOG_UNIT    94
+
+#endif
+
+#define APP_LENGTH_ADDRESS (CRC_ADDRESS - 4)  // Image length in bytes, same unit as the CRC
+#define VERIFIED_ADDRESS   (CRC_ADDRESS + 4)  // VERIFIED_MAGIC ^ CRC once the full CRC passed
+#define HEADER_CRC_ADDRESS (CRC_ADDRESS + 8)  // CRC of the first FAST_BOOT_HEADER_SIZE bytes
+#define BOOT_TALLY_ADDRESS (CRC_ADDRESS + 12) // Boot counter, one zeroed word per boot
+#define VERIFIED_MAGIC     0x5AFEB007U
 
+#define FAST_BOOT_INTERVAL    16  // Every n-th boot re-checks the full CRC (0 = always)
+#define FAST_BOOT_HEADER_SIZE 256 // Bytes hashed on a fast boot
+
+#define BOOT_LISTEN_MS       20          // Listen window for a bootloader frame on a plain boot
+#define BOOT_SESSION_MS      1000        // Jump to APP after this long without command once a session is open
+
+#define CAN_DRAIN_MS    20  // Longest wait for queued replies before a bit rate switch
+#define CAN_FALLBACK_MS 250 // Back to the default bit rate if nothing arrives at the new one for this long
+
+#define NODE_ID 0x02 // CAN node ID until one is assigned over the bus and stored in the node log
+
+// The shared addresses take 1/16 of the standard and extended ID space each, so on a bus with other
+// traffic choose ones nothing else uses (-DCAN_BROADCAST_ID / -DCAN_GROUP_ID in CMake)
+#ifndef BROADCAST_ID
+#define BROADCAST_ID 0x00 // Address accepted by every node
 #endif
+#ifndef GROUP_ID
+#define GROUP_ID 0x0F // Multicast group address accepted by this node
+#endif
+
+static_assert(BROADCAST_ID <= 0x0F && GROUP_ID <= 0x0F && BROADCAST_ID != GROUP_ID, "shared addresses are distinct 4-bit values");
+static_assert(NODE_ID != BROADCAST_ID && NODE_ID != GROUP_ID, "the factory node ID must be a unicast address");
+
+#define UID_WORDS      3    // 96-bit unique device ID, matched by fastscan one word at a time
+#define FASTSCAN_START 0x80 // Fastscan bit value that opens a new scan
+#define FASTSCAN_IDLE  0xFF // scanWord_ when the node takes no part in the scan
+
+#define STREAM_DEFAULT_WINDOW 16 // Stream data frames per ACK if the host proposes none
+#define STREAM_MAX_WINDOW     64 // Upper bound for the negotiated ACK window, one staging buffer
 
-#define NODE_ID 0x02 // CAN node ID
+static_assert(STREAM_MAX_WINDOW * 2 <= FlashInterface::STAGE_WORDS, "a window of stream frames must fit one staging buffer");
+static_assert(LZSS_MAX_FRAME_WORDS <= FlashInterface::STAGE_WORDS, "a compressed frame must fit one staging buffer");
+static_assert(STREAM_MAX_WINDOW <= CAN_RX_QUEUE_SIZE, "a compressed window waits in the RX ring while staging is full");
 
 class Bootloader
 {
 public:
-    Bootloader(FlashInterface &flash, CanInterface &can) : flash_(flash), can_(can), loaderMode_(true), flashInProgress_(false), flashIndex_(0) {}
+    Bootloader(FlashInterface &flash, CanInterface &can) : flash_(flash), can_(can), loaderMode_(true), flashInProgress_(false), flashIndex_(0), fec_(flash) {}
 
-    void processCanCmd(uint8_t id, uint8_t cmd, uint8_t *data, uint8_t len);
-    void run();
+    void processCanCmd(uint8_t dest, uint8_t cmd, uint8_t *data, uint8_t len);
+    void processDataFrame(uint8_t dest, uint8_t cmd, uint32_t index, uint8_t *data, uint8_t len);
+    void run(const BootMailbox *request = nullptr);
 
 private:
     volatile uint32_t lastCmdTick_ = 0;
@@ -76,7 +155,45 @@ private:
     bool loaderMode_;
     bool flashInProgress_;
     uint32_t flashIndex_;
+    FecDecoder fec_;
+    LzssDecoder lzss_;
+    bool session_ = false;
+    bool hostSession_ = false; // Opened by a unicast command, lets broadcast and group commands change state
+    bool streaming_ = false;
+    bool compressed_ = false; // Stream frames carry LZSS data for lzss_
+    uint8_t streamWindow_ = STREAM_DEFAULT_WINDOW;
+    uint8_t sessionWindow_ = STREAM_DEFAULT_WINDOW;
+    uint8_t sessionBitrate_ = 0;
+    uint8_t streamCount_ = 0;
+    bool ackPending_ = false; // Window complete, ACK held back until staging has room for the next
+    uint32_t reportedEraseDone_ = 0;
+    EraseState reportedEraseState_ = EraseState::Idle;
+    uint32_t hashNext_ = 0;
+    uint32_t hashEnd_ = 0;
+    uint32_t missingNext_ = 0;
+    uint32_t missingEnd_ = 0;
+    bool missingActive_ = false;
+    uint8_t scanWord_ = FASTSCAN_IDLE; // UID word the next fastscan query is matched against
+    bool selected_ = false;            // Whole UID matched, the next broadcast assign is ours
+    bool addressed_ = false;           // Runs on a node ID from the node log
+    bool rateProbation_ = false; // Switched bit rate not yet confirmed by a received frame
+    uint32_t rateTick_ = 0;
+    uint32_t rateTimeout_ = CAN_FALLBACK_MS;
 
     void sendConfirm(uint8_t id, uint8_t status);
     void sendCRC(uint8_t id, uint32_t crc);
+    void sendStreamAck(uint8_t id, uint8_t status);
+    void sendDiagnostics(uint8_t id);
+    void sendEraseProgress(uint8_t id);
+    void sendUnitHash(uint8_t id, uint32_t index);
+    void sendAppStatus(uint8_t id);
+    void sendProgramStats(uint8_t id);
+    void sendWriteAck(uint8_t id, uint8_t status, uint32_t offset);
+    void sendResumePoint(uint8_t id, uint16_t imageId);
+    void sendMissingRanges(uint8_t id);
+    // Staging space needed before the next window is ACKed; compressed frames that find no room wait in the RX ring
+    uint32_t windowWords() const { return compressed_ ? LZSS_MAX_FRAME_WORDS : streamWindow_ * 2u; }
+    void switchBitRate(uint8_t index, uint32_t timeoutMs);
+    void sendScanReply();
+    void sendUid(uint8_t id);
 };
\ No newline at end of file
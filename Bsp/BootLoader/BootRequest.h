@@ -0,0 +1,102 @@
+#pragma once
+#include <main.h>
+#include <cstdint>
+
+/*
+Reboot-into-bootloader mailbox, shared by the application and the bootloader.
+
+The application calls requestBootloader() which fills the mailbox in the first RAM words and
+resets. The bootloader defines the mailbox in BOOT_MAILBOX_SECTION, which its linker script
+places first in RAM (and asserts it), validates the CRC in Main(), clears the mailbox and stays
+in loader mode with the requested session. The application must not place data in the first
+BOOT_MAILBOX_SIZE bytes of RAM.
+*/
+
+#define BOOT_MAILBOX_ADDRESS 0x20000000U            // RAM_START, the application side of the contract
+#define BOOT_MAILBOX_SECTION ".noinit.bootmailbox" // Bootloader side, collected first by the linker script
+#define BOOT_MAILBOX_MAGIC   0xB007CA11U
+#define BOOT_MAILBOX_SIZE    12
+
+enum class BootReason : uint8_t {
+    None = 0,
+    Update = 1, // Host asked the application to start an update
+    User = 2,   // Operator request
+    Fault = 3,  // Application gave up on itself
+};
+
+// Pre-negotiated session, 0 keeps the bootloader default
+struct BootSession {
+    uint8_t bitrate = 0; // Bit timing index (README, Bit Rate), the host must talk at that rate
+    uint8_t window = 0;  // Stream frames per ACK
+    uint8_t slot = 0;    // Target image slot, only 0 (application region) for now
+};
+
+struct BootMailbox {
+    uint32_t magic;
+    uint8_t reason;
+    uint8_t bitrate;
+    uint8_t window;
+    uint8_t slot;
+    uint32_t crc; // CRC32 of the words above
+};
+
+static_assert(sizeof(BootMailbox) == BOOT_MAILBOX_SIZE, "mailbox layout is shared with the bootloader");
+
+// Plain bitwise CRC32 (0xEDB88320), no table or CRC unit needed on the application side
+inline uint32_t bootMailboxCRC(const BootMailbox &mailbox)
+{
+    const uint8_t *p = (const uint8_t *)&mailbox;
+    uint32_t crc = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < sizeof(BootMailbox) - 4; i++) {
+        crc ^= p[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+
+    return ~crc;
+}
+
+// Application side: leave the request and reset, does not return
+[[noreturn]] inline void requestBootloader(BootReason reason, const BootSession &session = BootSession())
+{
+    BootMailbox request;
+    request.magic = BOOT_MAILBOX_MAGIC;
+    request.reason = (uint8_t)reason;
+    request.bitrate = session.bitrate;
+    request.window = session.window;
+    request.slot = session.slot;
+    request.crc = bootMailboxCRC(request);
+
+    __disable_irq();
+    volatile BootMailbox *mailbox = (volatile BootMailbox *)BOOT_MAILBOX_ADDRESS;
+    mailbox->magic = request.magic;
+    mailbox->reason = request.reason;
+    mailbox->bitrate = request.bitrate;
+    mailbox->window = request.window;
+    mailbox->slot = request.slot;
+    mailbox->crc = request.crc;
+    __DSB();
+
+    NVIC_SystemReset();
+    while (1) {
+    }
+}
+
+// Bootloader side: true and the request if a valid one is pending, the mailbox is cleared either way
+inline bool takeBootRequest(BootMailbox &storage, BootMailbox &request)
+{
+    volatile BootMailbox *mailbox = &storage;
+
+    request.magic = mailbox->magic;
+    request.reason = mailbox->reason;
+    request.bitrate = mailbox->bitrate;
+    request.window = mailbox->window;
+    request.slot = mailbox->slot;
+    request.crc = mailbox->crc;
+
+    mailbox->magic = 0;
+    mailbox->crc = 0;
+
+    return request.magic == BOOT_MAILBOX_MAGIC && request.crc == bootMailboxCRC(request);
+}
@@ -2,29 +2,54 @@
 #include "CanInterface.h"
 #include "BootLoader.h"
 
+// Validated entries for index 1..CAN_BIT_RATES-1, same time quanta and sample point as the CubeMX default
+#if defined(STM32F1xx)
+// 36 MHz APB1, 9 quanta, sample point 66.7 %
+static const CanBitTiming bitTimings[CAN_BIT_RATES - 1] = {
+    {125000, 32, CAN_BS1_5TQ, CAN_BS2_3TQ},
+    {250000, 16, CAN_BS1_5TQ, CAN_BS2_3TQ},
+    {500000, 8, CAN_BS1_5TQ, CAN_BS2_3TQ},
+    {1000000, 4, CAN_BS1_5TQ, CAN_BS2_3TQ},
+};
+#else
+// 50 MHz APB1, 10 quanta, sample point 60 %
+static const CanBitTiming bitTimings[CAN_BIT_RATES - 1] = {
+    {125000, 40, CAN_BS1_5TQ, CAN_BS2_4TQ},
+    {250000, 20, CAN_BS1_5TQ, CAN_BS2_4TQ},
+    {500000, 10, CAN_BS1_5TQ, CAN_BS2_4TQ},
+    {1000000, 5, CAN_BS1_5TQ, CAN_BS2_4TQ},
+};
+#endif
+
+static uint32_t bitQuanta(const CanBitTiming &timing)
+{
+    return 1 + ((timing.timeSeg1 >> CAN_BTR_TS1_Pos) + 1) + ((timing.timeSeg2 >> CAN_BTR_TS2_Pos) + 1);
+}
+
 CanInterface::CanInterface(CAN_HandleTypeDef *hcan, uint16_t nodeId) : hcan_(hcan), nodeId_(nodeId), txMailbox_(0)
 {
 }
 
 void CanInterface::init()
 {
-    CAN_FilterTypeDef filterConfig;
-
-    filterConfig.FilterBank = 0;
-    filterConfig.FilterFIFOAssignment = CAN_RX_FIFO0;
-    filterConfig.FilterMode = CAN_FILTERMODE_IDMASK;
-    filterConfig.FilterScale = CAN_FILTERSCALE_32BIT;
-    filterConfig.FilterIdHigh = 0x0000;
-    filterConfig.FilterIdLow = 0x0000;
-    filterConfig.FilterMaskIdHigh = 0x0000;
-    filterConfig.FilterMaskIdLow = 0x0000;
-    filterConfig.FilterActivation = ENABLE;
-    filterConfig.SlaveStartFilterBank = 14;
-
-    if (HAL_CAN_ConfigFilter(hcan_, &filterConfig) != HAL_OK) {
+    // Let the controller retry lost arbitration instead of silently dropping the frame
+    hcan_->Init.AutoRetransmission = ENABLE;
+    if (HAL_CAN_Init(hcan_) != HAL_OK) {
         Error_Handler();
     }
 
+    // Bit rate index 0, where setBitRate() falls back to
+    defaultTiming_.prescaler = hcan_->Init.Prescaler;
+    defaultTiming_.timeSeg1 = hcan_->Init.TimeSeg1;
+    defaultTiming_.timeSeg2 = hcan_->Init.TimeSeg2;
+    defaultTiming_.bitRate = HAL_RCC_GetPCLK1Freq() / (defaultTiming_.prescaler * bitQuanta(defaultTiming_));
+    bitRate_ = 0;
+
+    // Only our unicast, the broadcast and the group address reach the CPU
+    configFilter(0, nodeId_);
+    configFilter(1, BROADCAST_ID);
+    configFilter(2, GROUP_ID);
+
     /*start can*/
     HAL_CAN_Start(hcan_);
     HAL_CAN_ActivateNotification(hcan_,
@@ -46,23 +71,195 @@ void CanInterface::init()
     txHeader_.TransmitGlobalTime = DISABLE;
 }
 
-void CanInterface::send(const uint8_t *data, uint8_t len)
+void CanInterface::setNodeId(uint16_t nodeId)
 {
-    if (len > 8) len = 8;
-    for (uint8_t i = 0; i < len; i++)
-        txData_[i] = data[i];
+    nodeId_ = nodeId;
+    txHeader_.StdId = nodeId_;
+
+    // Before init() the controller takes no filter configuration, init() sets bank 0 from nodeId_
+    if (hcan_->State != HAL_CAN_STATE_RESET) {
+        configFilter(0, nodeId_);
+    }
+}
+
+bool CanInterface::bitRateValid(uint8_t index) const
+{
+    if (index == 0) {
+        return true;
+    }
+    if (index >= CAN_BIT_RATES) {
+        return false;
+    }
 
-    txMailbox_ = 0;
-    HAL_CAN_AddTxMessage(hcan_, &txHeader_, txData_, &txMailbox_);
+    // Refuse an entry that does not give the exact rate, e.g. on a different clock tree
+    const CanBitTiming &timing = bitTimings[index - 1];
+    return HAL_RCC_GetPCLK1Freq() == timing.bitRate * timing.prescaler * bitQuanta(timing);
+}
+
+bool CanInterface::setBitRate(uint8_t index)
+{
+    if (!bitRateValid(index)) {
+        return false;
+    }
+
+    const CanBitTiming &timing = (index == 0) ? defaultTiming_ : bitTimings[index - 1];
+
+    // Re-init only rewrites the mode and bit timing registers, the filters and interrupt enables stay
+    HAL_CAN_Stop(hcan_);
+    hcan_->Init.Prescaler = timing.prescaler;
+    hcan_->Init.TimeSeg1 = timing.timeSeg1;
+    hcan_->Init.TimeSeg2 = timing.timeSeg2;
+    if (HAL_CAN_Init(hcan_) != HAL_OK || HAL_CAN_Start(hcan_) != HAL_OK) {
+        Error_Handler();
+    }
+
+    bitRate_ = index;
+    return true;
+}
+
+bool CanInterface::drainTx(uint32_t timeoutMs)
+{
+    uint32_t start = HAL_GetTick();
+    while (!txQueue_.empty() || HAL_CAN_GetTxMailboxesFreeLevel(hcan_) < 3) {
+        if ((uint32_t)(HAL_GetTick() - start) > timeoutMs) {
+            // Nobody acknowledges, drop what is left rather than send it at another rate;
+            // with the mailbox-empty interrupt masked we are the only consumer of the queue
+            __HAL_CAN_DISABLE_IT(hcan_, CAN_IT_TX_MAILBOX_EMPTY);
+            CanFrame frame;
+            while (txQueue_.pop(frame)) {
+            }
+            HAL_CAN_AbortTxRequest(hcan_, CAN_TX_MAILBOX0 | CAN_TX_MAILBOX1 | CAN_TX_MAILBOX2);
+            __HAL_CAN_ENABLE_IT(hcan_, CAN_IT_TX_MAILBOX_EMPTY);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Std ID layout is (address << 7) | cmd, so a 16-bit mask on the upper 4 ID bits selects one address.
+// 16-bit filter format: STDID[10:0] << 5 | RTR << 4 | IDE << 3 | EXID[17:15]
+// Extended IDs carry the same 11 bits on top (ID[28:18]), so IDE is left open and one bank
+// takes both the standard commands and the extended data frames of an address.
+void CanInterface::configFilter(uint32_t bank, uint16_t address)
+{
+    const uint32_t id = (uint32_t)(address & 0x0F) << 12;
+    const uint32_t mask = 0xF000 | 0x0010; // Address bits, data frame
+
+    CAN_FilterTypeDef filterConfig;
+
+    filterConfig.FilterBank = bank;
+    filterConfig.FilterFIFOAssignment = CAN_RX_FIFO0;
+    filterConfig.FilterMode = CAN_FILTERMODE_IDMASK;
+    filterConfig.FilterScale = CAN_FILTERSCALE_16BIT;
+    filterConfig.FilterIdHigh = id;
+    filterConfig.FilterIdLow = id;
+    filterConfig.FilterMaskIdHigh = mask;
+    filterConfig.FilterMaskIdLow = mask;
+    filterConfig.FilterActivation = ENABLE;
+    filterConfig.SlaveStartFilterBank = 14;
+
+    if (HAL_CAN_ConfigFilter(hcan_, &filterConfig) != HAL_OK) {
+        Error_Handler();
+    }
+}
+
+void CanInterface::send(const uint8_t *data, uint8_t len)
+{
+    send(nodeId_, data, len);
 }
 
 void CanInterface::send(uint32_t id, const uint8_t *data, uint8_t len)
 {
     if (len > 8) len = 8;
-    for (uint8_t i = 0; i < len; i++)
-        txData_[i] = data[i];
 
-    txHeader_.StdId = id;
-    txMailbox_ = 0;
-    HAL_CAN_AddTxMessage(hcan_, &txHeader_, txData_, &txMailbox_);
+    CanFrame frame;
+    frame.id = id;
+    frame.extended = false;
+    frame.len = len;
+    for (uint8_t i = 0; i < 8; i++)
+        frame.data[i] = (i < len) ? data[i] : 0;
+
+    // A full queue drops the frame and counts it in txDrops()
+    txQueue_.push(frame);
+
+    // Masking the mailbox-empty interrupt makes us the only consumer while we feed the mailboxes
+    __HAL_CAN_DISABLE_IT(hcan_, CAN_IT_TX_MAILBOX_EMPTY);
+    pumpTx();
+    __HAL_CAN_ENABLE_IT(hcan_, CAN_IT_TX_MAILBOX_EMPTY);
+}
+
+void CanInterface::pumpTx()
+{
+    CanFrame frame;
+    while (HAL_CAN_GetTxMailboxesFreeLevel(hcan_) > 0 && txQueue_.peek(frame)) {
+        txHeader_.StdId = frame.id;
+        for (uint8_t i = 0; i < 8; i++)
+            txData_[i] = frame.data[i];
+
+        txMailbox_ = 0;
+        if (HAL_CAN_AddTxMessage(hcan_, &txHeader_, txData_, &txMailbox_) != HAL_OK) {
+            break; // Retried on the next mailbox-empty interrupt
+        }
+        txQueue_.pop(frame);
+    }
+}
+
+void CanInterface::onTxMailboxEmpty()
+{
+    // send() masks the interrupt while it feeds the mailboxes itself
+    if (hcan_->Instance->IER & CAN_IER_TMEIE) {
+        pumpTx();
+    }
+}
+
+void CanInterface::onRxFifo0Pending()
+{
+    // Empty the whole hardware FIFO, it is only 3 frames deep
+    while (HAL_CAN_GetRxFifoFillLevel(hcan_, CAN_RX_FIFO0) > 0) {
+        if (HAL_CAN_GetRxMessage(hcan_, CAN_RX_FIFO0, &rxHeader_, rxData_) != HAL_OK) {
+            Error_Handler();
+        }
+
+        CanFrame frame;
+        frame.extended = (rxHeader_.IDE == CAN_ID_EXT);
+        frame.id = frame.extended ? rxHeader_.ExtId : rxHeader_.StdId;
+        frame.len = (rxHeader_.DLC > 8) ? 8 : (uint8_t)rxHeader_.DLC;
+        for (uint8_t i = 0; i < 8; i++)
+            frame.data[i] = rxData_[i];
+
+        rxQueue_.push(frame);
+    }
+}
+
+// Runs with interrupts masked during an erase, so it replaces the RX interrupt as producer
+__RAM_FUNC void CanInterface::pollRxFifo0()
+{
+    CAN_TypeDef *can = hcan_->Instance;
+
+    while (can->RF0R & CAN_RF0R_FMP0) {
+        CAN_FIFOMailBox_TypeDef &mailbox = can->sFIFOMailBox[CAN_RX_FIFO0];
+        uint32_t dlc = mailbox.RDTR & CAN_RDT0R_DLC;
+        uint32_t low = mailbox.RDLR;
+        uint32_t high = mailbox.RDHR;
+
+        uint32_t rir = mailbox.RIR;
+
+        CanFrame frame;
+        frame.extended = (rir & CAN_RI0R_IDE) != 0;
+        frame.id = frame.extended ? (rir & (CAN_RI0R_STID | CAN_RI0R_EXID)) >> CAN_RI0R_EXID_Pos
+                                  : (rir & CAN_RI0R_STID) >> CAN_RI0R_STID_Pos;
+        frame.len = (dlc > 8) ? 8 : (uint8_t)dlc;
+        for (uint8_t i = 0; i < 4; i++) {
+            frame.data[i] = (low >> (8 * i)) & 0xFF;
+            frame.data[i + 4] = (high >> (8 * i)) & 0xFF;
+        }
+
+        can->RF0R = CAN_RF0R_RFOM0; // Release the output mailbox
+        rxQueue_.push(frame);
+    }
+}
+
+bool CanInterface::receive(CanFrame &frame)
+{
+    return rxQueue_.pop(frame);
 }
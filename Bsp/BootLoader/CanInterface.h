@@ -2,6 +2,25 @@
 #pragma once
 #include <can.h>
 #include <cstdint>
+#include "RingBuffer.h"
+
+#define CAN_RX_QUEUE_SIZE 64 // Frames buffered between RX interrupt and main loop (power of two)
+#define CAN_TX_QUEUE_SIZE 16 // Frames waiting for a free TX mailbox (power of two)
+#define CAN_BIT_RATES     5  // Bit timing table entries, index 0 is the timing init() found
+
+struct CanFrame {
+    uint32_t id; // 11-bit standard or 29-bit extended identifier
+    bool extended;
+    uint8_t len;
+    uint8_t data[8];
+};
+
+struct CanBitTiming {
+    uint32_t bitRate;   // bit/s
+    uint32_t prescaler;
+    uint32_t timeSeg1;  // CAN_BS1_xTQ
+    uint32_t timeSeg2;  // CAN_BS2_xTQ
+};
 
 class CanInterface {
 public:
@@ -10,7 +29,30 @@ public:
     void send(const uint8_t* data, uint8_t len);
     void send(uint32_t id, const uint8_t* data, uint8_t len);
 
+    void onRxFifo0Pending();        // Called from the RX FIFO0 interrupt
+    void pollRxFifo0();             // Same, register level from RAM while flash is busy
+    void onTxMailboxEmpty();        // Called from the TX mailbox interrupts
+    bool receive(CanFrame& frame); // Called from the main loop
+    bool peek(CanFrame& frame) const { return rxQueue_.peek(frame); } // Next frame, left in the queue
+    bool rxPending() const { return !rxQueue_.empty(); }
+    uint16_t nodeId() const { return nodeId_; }
+    void setNodeId(uint16_t nodeId); // Takes effect on the unicast filter right away
+
+    bool bitRateValid(uint8_t index) const; // Entry exists and is exact at the current APB1 clock
+    bool setBitRate(uint8_t index);          // Restarts the controller, filters are kept
+    uint8_t bitRate() const { return bitRate_; }
+    bool drainTx(uint32_t timeoutMs);        // Wait until every queued frame is on the bus
+
+    uint32_t rxOverruns() const { return rxQueue_.overruns(); }
+    uint32_t rxHighWater() const { return rxQueue_.highWater(); }
+    uint32_t txDrops() const { return txQueue_.overruns(); }
+    uint32_t txHighWater() const { return txQueue_.highWater(); }
+    uint32_t txPending() const { return txQueue_.size(); }
+
 private:
+    void configFilter(uint32_t bank, uint16_t address);
+    void pumpTx();
+
     CAN_HandleTypeDef* hcan_;
     CAN_TxHeaderTypeDef txHeader_;
     CAN_RxHeaderTypeDef rxHeader_;
@@ -18,4 +60,8 @@ private:
     uint8_t rxData_[8];
     uint32_t txMailbox_;
     uint16_t nodeId_;
+    uint8_t bitRate_ = 0;
+    CanBitTiming defaultTiming_;
+    RingBuffer<CanFrame, CAN_RX_QUEUE_SIZE> rxQueue_;
+    RingBuffer<CanFrame, CAN_TX_QUEUE_SIZE> txQueue_;
 };
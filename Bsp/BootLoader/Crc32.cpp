@@ -0,0 +1,54 @@
+// Crc32.cpp
+#include "Crc32.h"
+
+#if defined(STM32F4xx)
+#include "stm32f4xx_hal.h"
+#elif defined(STM32F1xx)
+#include "stm32f1xx_hal.h"
+#endif
+
+#define CRC32_HW_POLY 0x04C11DB7U
+
+// Undo 32 MSB-first shift steps of the CRC unit
+static uint32_t unshift32(uint32_t c)
+{
+    for (int i = 0; i < 32; i++)
+        c = (c & 1) ? ((c ^ CRC32_HW_POLY) >> 1) | 0x80000000U : (c >> 1);
+    return c;
+}
+
+uint32_t Crc32Hardware::update(uint32_t crc, const uint32_t *words, uint32_t count)
+{
+    __HAL_RCC_CRC_CLK_ENABLE();
+
+    // The unit has no init register: after a reset DR is 0xFFFFFFFF, so one crafted word
+    // lands it on any state. Skipped when DR already continues the previous call.
+    uint32_t state = __RBIT(crc);
+    if (CRC->DR != state) {
+        CRC->CR = CRC_CR_RESET;
+        if (state != 0xFFFFFFFF) {
+            CRC->DR = 0xFFFFFFFF ^ unshift32(state);
+        }
+    }
+
+    while (count--) {
+        CRC->DR = __RBIT(*words++);
+    }
+
+    return __RBIT(CRC->DR);
+}
+
+uint32_t Crc32::update(uint32_t crc, const uint32_t *words, uint32_t count)
+{
+#if CRC32_ENGINE == CRC32_ENGINE_BITWISE
+    return Crc32Bitwise::update(crc, words, count);
+#elif CRC32_ENGINE == CRC32_ENGINE_TABLE
+    return Crc32Table::update(crc, words, count);
+#elif CRC32_ENGINE == CRC32_ENGINE_SLICE4
+    return Crc32Slice4::update(crc, words, count);
+#elif CRC32_ENGINE == CRC32_ENGINE_SLICE8
+    return Crc32Slice8::update(crc, words, count);
+#else
+    return Crc32Hardware::update(crc, words, count);
+#endif
+}
@@ -0,0 +1,121 @@
+// Crc32.h
+#pragma once
+#include <cstdint>
+
+// CRC-32 as stored at CRC_ADDRESS: reflected polynomial 0xEDB88320, init and final xor
+// 0xFFFFFFFF, fed with the image as little-endian 32-bit words.
+// All engines return the same register value; pick one per build by flash budget.
+#define CRC32_ENGINE_BITWISE  0 // No table, 32 shifts per word
+#define CRC32_ENGINE_TABLE    1 // 1 KB table, one lookup per byte
+#define CRC32_ENGINE_SLICE4   2 // 4 KB table, one word per step
+#define CRC32_ENGINE_SLICE8   3 // 8 KB table, two words per step
+#define CRC32_ENGINE_HARDWARE 4 // STM32 CRC unit, no table
+
+#ifndef CRC32_ENGINE
+#define CRC32_ENGINE CRC32_ENGINE_HARDWARE
+#endif
+
+#define CRC32_POLY 0xEDB88320U
+
+template <uint32_t Slices>
+struct Crc32Tables {
+    uint32_t t[Slices][256];
+};
+
+// t[0] is the classic byte table, t[s] advances t[s - 1] by one more zero byte
+template <uint32_t Slices>
+constexpr Crc32Tables<Slices> makeCrc32Tables()
+{
+    Crc32Tables<Slices> tables{};
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ CRC32_POLY : (c >> 1);
+        tables.t[0][i] = c;
+    }
+
+    for (uint32_t s = 1; s < Slices; s++)
+        for (uint32_t i = 0; i < 256; i++)
+            tables.t[s][i] = (tables.t[s - 1][i] >> 8) ^ tables.t[0][tables.t[s - 1][i] & 0xFF];
+
+    return tables;
+}
+
+template <uint32_t Slices>
+inline constexpr Crc32Tables<Slices> crc32Tables = makeCrc32Tables<Slices>();
+
+struct Crc32Bitwise {
+    static uint32_t update(uint32_t crc, const uint32_t *words, uint32_t count)
+    {
+        while (count--) {
+            crc ^= *words++;
+            for (int i = 0; i < 32; i++)
+                crc = (crc & 1) ? (crc >> 1) ^ CRC32_POLY : (crc >> 1);
+        }
+        return crc;
+    }
+};
+
+struct Crc32Table {
+    static uint32_t update(uint32_t crc, const uint32_t *words, uint32_t count)
+    {
+        const auto &t = crc32Tables<1>.t;
+        while (count--) {
+            crc ^= *words++;
+            crc = (crc >> 8) ^ t[0][crc & 0xFF];
+            crc = (crc >> 8) ^ t[0][crc & 0xFF];
+            crc = (crc >> 8) ^ t[0][crc & 0xFF];
+            crc = (crc >> 8) ^ t[0][crc & 0xFF];
+        }
+        return crc;
+    }
+};
+
+struct Crc32Slice4 {
+    static uint32_t update(uint32_t crc, const uint32_t *words, uint32_t count)
+    {
+        const auto &t = crc32Tables<4>.t;
+        while (count--) {
+            uint32_t x = crc ^ *words++;
+            crc = t[3][x & 0xFF] ^ t[2][(x >> 8) & 0xFF] ^ t[1][(x >> 16) & 0xFF] ^ t[0][x >> 24];
+        }
+        return crc;
+    }
+};
+
+struct Crc32Slice8 {
+    static uint32_t update(uint32_t crc, const uint32_t *words, uint32_t count)
+    {
+        const auto &t = crc32Tables<8>.t;
+        for (; count >= 2; count -= 2) {
+            uint32_t one = crc ^ *words++;
+            uint32_t two = *words++;
+            crc = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^ t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24] ^
+                  t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^ t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+        }
+        if (count) {
+            uint32_t x = crc ^ *words;
+            crc = t[3][x & 0xFF] ^ t[2][(x >> 8) & 0xFF] ^ t[1][(x >> 16) & 0xFF] ^ t[0][x >> 24];
+        }
+        return crc;
+    }
+};
+
+// STM32 CRC unit (polynomial 0x04C11DB7, MSB first); bit-reversing input and output
+// turns it into the reflected CRC above. The running value lives in CRC->DR.
+struct Crc32Hardware {
+    static uint32_t update(uint32_t crc, const uint32_t *words, uint32_t count);
+};
+
+class Crc32
+{
+public:
+    static constexpr uint32_t INIT = 0xFFFFFFFF;
+
+    // Feed `count` words into a running (not yet inverted) CRC register
+    static uint32_t update(uint32_t crc, const uint32_t *words, uint32_t count);
+    static uint32_t finish(uint32_t crc) { return ~crc; }
+
+    static uint32_t compute(const uint32_t *words, uint32_t count) { return finish(update(INIT, words, count)); }
+};
@@ -0,0 +1,189 @@
+// Fec.cpp
+#include "Fec.h"
+#include "FlashInterface.h"
+
+static_assert(FEC_SYMBOLS * FEC_SYMBOL_SIZE == WRITTEN_BLOCK_SIZE, "a generation is one written-map block");
+static_assert(FEC_SYMBOLS == 32, "source symbols are tracked in a 32-bit mask");
+static_assert(2 * FEC_SYMBOLS <= 256, "Cauchy points must be distinct field elements");
+
+void FecDecoder::reset()
+{
+    for (Slot &slot : slots_) {
+        slot.used = false;
+    }
+    recovered_ = 0;
+}
+
+// The generation's slot, a free one or the least recently used one (its generation is left to repair)
+FecDecoder::Slot *FecDecoder::slotFor(uint32_t generation)
+{
+    Slot *victim = &slots_[0];
+    for (Slot &slot : slots_) {
+        if (slot.used && slot.generation == generation) {
+            slot.lastUse = ++uses_;
+            return &slot;
+        }
+        if (!slot.used) {
+            victim = &slot;
+        } else if (victim->used && slot.lastUse < victim->lastUse) {
+            victim = &slot;
+        }
+    }
+
+    // A generation that was evicted before keeps its source symbols in flash, only the repairs are gone
+    uint32_t base = generation * FEC_SYMBOLS * FEC_SYMBOL_SIZE;
+    victim->used = true;
+    victim->generation = generation;
+    victim->have = 0;
+    for (uint32_t j = 0; j < FEC_SYMBOLS; j++) {
+        if (flash_.rangeWritten(base + j * FEC_SYMBOL_SIZE, FEC_SYMBOL_SIZE)) {
+            victim->have |= 1UL << j;
+        }
+    }
+    victim->repairCount = 0;
+    victim->lastUse = ++uses_;
+    return victim;
+}
+
+bool FecDecoder::writeSymbol(uint32_t generation, uint32_t index, const uint8_t *data)
+{
+    uint32_t offset = generation * FEC_SYMBOLS * FEC_SYMBOL_SIZE + index * FEC_SYMBOL_SIZE;
+    for (uint32_t i = 0; i < FEC_SYMBOL_SIZE; i += 4) {
+        uint32_t word = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16) | (data[i + 3] << 24);
+        if (!flash_.writeAt(offset + i, word)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FecDecoder::onSymbol(uint32_t generation, uint8_t symbol, const uint8_t *data)
+{
+    if (symbol >= 2 * FEC_SYMBOLS || flash_.blockWritten(generation)) {
+        return true;
+    }
+
+    Slot *slot = slotFor(generation);
+
+    if (symbol < FEC_SYMBOLS) {
+        if (!(slot->have & (1UL << symbol))) {
+            if (!writeSymbol(generation, symbol, data)) {
+                return false;
+            }
+            slot->have |= 1UL << symbol;
+        }
+    } else if (slot->repairCount < FEC_MAX_REPAIR) {
+        for (uint8_t r = 0; r < slot->repairCount; r++) {
+            if (slot->repairSymbol[r] == symbol) {
+                return true;
+            }
+        }
+        slot->repairSymbol[slot->repairCount] = symbol;
+        for (uint32_t b = 0; b < FEC_SYMBOL_SIZE; b++) {
+            slot->repair[slot->repairCount][b] = data[b];
+        }
+        slot->repairCount++;
+    }
+
+    return tryDecode(*slot);
+}
+
+// Once there are as many repair symbols as missing source symbols, take out the known source
+// symbols (read back from flash) and solve for the missing ones by Gaussian elimination
+bool FecDecoder::tryDecode(Slot &slot)
+{
+    uint8_t columns[FEC_SYMBOLS];
+    uint32_t missing = 0;
+    for (uint32_t j = 0; j < FEC_SYMBOLS; j++) {
+        if (!(slot.have & (1UL << j))) {
+            columns[missing++] = (uint8_t)j;
+        }
+    }
+
+    if (missing > slot.repairCount) {
+        return true;
+    }
+
+    uint32_t base = slot.generation * FEC_SYMBOLS * FEC_SYMBOL_SIZE;
+    uint32_t rows = slot.repairCount;
+    uint8_t a[FEC_MAX_REPAIR][FEC_MAX_REPAIR];
+    uint8_t rhs[FEC_MAX_REPAIR][FEC_SYMBOL_SIZE];
+
+    for (uint32_t r = 0; r < rows; r++) {
+        uint8_t coef[FEC_SYMBOLS];
+        fecCoefficients(slot.repairSymbol[r], coef);
+
+        for (uint32_t b = 0; b < FEC_SYMBOL_SIZE; b++) {
+            rhs[r][b] = slot.repair[r][b];
+        }
+        for (uint32_t j = 0; j < FEC_SYMBOLS; j++) {
+            if (!(slot.have & (1UL << j))) {
+                continue;
+            }
+            for (uint32_t w = 0; w < FEC_SYMBOL_SIZE; w += 4) {
+                uint32_t word = flash_.readAt(base + j * FEC_SYMBOL_SIZE + w);
+                for (uint32_t b = 0; b < 4; b++) {
+                    rhs[r][w + b] ^= gfMul(coef[j], (word >> (8 * b)) & 0xFF);
+                }
+            }
+        }
+        for (uint32_t k = 0; k < missing; k++) {
+            a[r][k] = coef[columns[k]];
+        }
+    }
+
+    for (uint32_t k = 0; k < missing; k++) {
+        uint32_t pivot = k;
+        while (pivot < rows && a[pivot][k] == 0) {
+            pivot++;
+        }
+        if (pivot == rows) {
+            return true; // Not independent yet, wait for more repair symbols
+        }
+
+        if (pivot != k) {
+            for (uint32_t c = 0; c < missing; c++) {
+                uint8_t t = a[k][c];
+                a[k][c] = a[pivot][c];
+                a[pivot][c] = t;
+            }
+            for (uint32_t b = 0; b < FEC_SYMBOL_SIZE; b++) {
+                uint8_t t = rhs[k][b];
+                rhs[k][b] = rhs[pivot][b];
+                rhs[pivot][b] = t;
+            }
+        }
+
+        uint8_t inv = gfInv(a[k][k]);
+        for (uint32_t c = 0; c < missing; c++) {
+            a[k][c] = gfMul(a[k][c], inv);
+        }
+        for (uint32_t b = 0; b < FEC_SYMBOL_SIZE; b++) {
+            rhs[k][b] = gfMul(rhs[k][b], inv);
+        }
+
+        for (uint32_t r = 0; r < rows; r++) {
+            uint8_t f = a[r][k];
+            if (r == k || f == 0) {
+                continue;
+            }
+            for (uint32_t c = 0; c < missing; c++) {
+                a[r][c] ^= gfMul(f, a[k][c]);
+            }
+            for (uint32_t b = 0; b < FEC_SYMBOL_SIZE; b++) {
+                rhs[r][b] ^= gfMul(f, rhs[k][b]);
+            }
+        }
+    }
+
+    for (uint32_t k = 0; k < missing; k++) {
+        if (!writeSymbol(slot.generation, columns[k], rhs[k])) {
+            return false;
+        }
+        slot.have |= 1UL << columns[k];
+    }
+    recovered_ += missing;
+
+    slot.used = false;
+    return true;
+}
@@ -0,0 +1,90 @@
+// Fec.h
+#pragma once
+#include <cstdint>
+
+class FlashInterface;
+
+// Erasure-coded broadcast: systematic Cauchy code over GF(256) per generation.
+// A generation is FEC_SYMBOLS symbols of FEC_SYMBOL_SIZE bytes (one written-map block). Symbols
+// 0..31 are the image bytes themselves, symbols 32..63 are repair symbols: sum over j of
+// c(symbol, j) * source[j], coefficients from fecCoefficients(). The code is MDS: any 32
+// distinct symbols of a generation rebuild it.
+#define FEC_SYMBOLS      32
+#define FEC_SYMBOL_SIZE  8
+#define FEC_WINDOW       4  // Generations decoded at the same time
+#define FEC_MAX_REPAIR   16 // Repair symbols kept per generation (tolerates 50 % loss)
+#define FEC_GF_POLY      0x11D
+
+struct Gf256Tables {
+    uint8_t exp[512];
+    uint8_t log[256];
+};
+
+constexpr Gf256Tables makeGf256Tables()
+{
+    Gf256Tables tables{};
+    uint32_t x = 1;
+    for (uint32_t i = 0; i < 255; i++) {
+        tables.exp[i] = (uint8_t)x;
+        tables.log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= FEC_GF_POLY;
+    }
+    for (uint32_t i = 255; i < 512; i++)
+        tables.exp[i] = tables.exp[i - 255];
+    return tables;
+}
+
+inline constexpr Gf256Tables gf256Tables = makeGf256Tables();
+
+inline uint8_t gfMul(uint8_t a, uint8_t b)
+{
+    return (a && b) ? gf256Tables.exp[gf256Tables.log[a] + gf256Tables.log[b]] : 0;
+}
+
+inline uint8_t gfInv(uint8_t a)
+{
+    return gf256Tables.exp[255 - gf256Tables.log[a]];
+}
+
+// Coefficients of repair symbol s (32..63): c[j] = 1 / (s + j), a Cauchy matrix since the repair
+// and source indices never meet. Every square submatrix is nonsingular, so k repair symbols
+// always recover any k lost source symbols.
+inline void fecCoefficients(uint8_t symbol, uint8_t coef[FEC_SYMBOLS])
+{
+    for (uint32_t j = 0; j < FEC_SYMBOLS; j++) {
+        coef[j] = gfInv((uint8_t)(symbol ^ j));
+    }
+}
+
+class FecDecoder
+{
+public:
+    explicit FecDecoder(FlashInterface &flash) : flash_(flash) {}
+
+    bool onSymbol(uint32_t generation, uint8_t symbol, const uint8_t *data); // False if a write failed
+    void reset();
+
+    uint32_t recovered() const { return recovered_; } // Symbols rebuilt from repair symbols
+
+private:
+    struct Slot {
+        bool used;
+        uint32_t generation;
+        uint32_t have; // Source symbols in flash
+        uint32_t lastUse;
+        uint8_t repairCount;
+        uint8_t repairSymbol[FEC_MAX_REPAIR];
+        uint8_t repair[FEC_MAX_REPAIR][FEC_SYMBOL_SIZE];
+    };
+
+    Slot *slotFor(uint32_t generation);
+    bool writeSymbol(uint32_t generation, uint32_t index, const uint8_t *data);
+    bool tryDecode(Slot &slot);
+
+    FlashInterface &flash_;
+    Slot slots_[FEC_WINDOW] = {};
+    uint32_t uses_ = 0;
+    uint32_t recovered_ = 0;
+};
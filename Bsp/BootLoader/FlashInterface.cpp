@@ -1,5 +1,7 @@
 #include "FlashInterface.h"
 #include "BootLoader.h"
+#include "Crc32.h"
+#include "FlashProgram.h"
 
 #if defined(STM32F4xx)
 #include "stm32f4xx_hal.h"
@@ -7,7 +9,12 @@
 #include "stm32f1xx_hal.h"
 #endif
 
-FlashInterface::FlashInterface(uint32_t appStart, uint32_t appEnd) : appStart_(appStart), appEnd_(appEnd), flashAddress_(appStart)
+static_assert(WRITTEN_BLOCK_SIZE % 4 == 0, "written map blocks are whole words");
+static_assert(FlashInterface::MAX_BLOCKS * WRITTEN_BLOCK_SIZE >= APP_END_ADDRESS - APP_START_ADDRESS, "written map too small");
+
+FlashInterface::FlashInterface(uint32_t appStart, uint32_t appEnd) : appStart_(appStart), appEnd_(appEnd), flashAddress_(appStart), writtenEnd_(appStart), stageEnd_(appStart),
+                                                                  journal_(JOURNAL_ADDRESS, JOURNAL_SIZE, JOURNAL_UNIT),
+                                                                  nodeLog_(NODE_LOG_ADDRESS, NODE_LOG_SIZE, NODE_LOG_UNIT)
 {
     // Ensure application start address is after bootloader
     if (appStart_ < APP_START_ADDRESS) {
@@ -104,10 +111,89 @@ static bool calculatePages(uint32_t startAddr, uint32_t endAddr,
 }
 #endif
 
-bool FlashInterface::eraseApplication()
+// Erase units are sectors on F4 and pages on F1
+static uint32_t addrToUnit(uint32_t addr)
+{
+#if defined(STM32F4xx)
+    return addrToSector(addr);
+#elif defined(STM32F1xx)
+    return addrToPage(addr);
+#endif
+}
+
+// First address of an erase unit; unitAddress(unit + 1) is its end
+static uint32_t unitAddress(uint32_t unit)
+{
+#if defined(STM32F4xx)
+    static const uint32_t sectorAddress[] = {
+        0x08000000, 0x08004000, 0x08008000, 0x0800C000, 0x08010000, 0x08020000, 0x08040000,
+        0x08060000, 0x08080000, 0x080A0000, 0x080C0000, 0x080E0000, 0x08100000,
+    };
+    return sectorAddress[(unit < 12) ? unit : 12];
+#elif defined(STM32F1xx)
+    return FLASH_BASE + (unit * FLASH_PAGE_SIZE);
+#endif
+}
+
+// True if [start, end) reads as erased flash, checks 32 bytes per iteration
+static bool isBlank(uint32_t start, uint32_t end)
+{
+    const volatile uint32_t *p = (const volatile uint32_t *)start;
+    const volatile uint32_t *last = (const volatile uint32_t *)end;
+
+    while (p + 8 <= last) {
+        uint32_t acc = p[0] & p[1] & p[2] & p[3] & p[4] & p[5] & p[6] & p[7];
+        if (acc != 0xFFFFFFFF) {
+            return false;
+        }
+        p += 8;
+    }
+
+    while (p < last) {
+        if (*p++ != 0xFFFFFFFF) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool calculateUnits(uint32_t startAddr, uint32_t endAddr,
+                           uint32_t &startUnit, uint32_t &nbUnits)
+{
+#if defined(STM32F4xx)
+    return calculateSectors(startAddr, endAddr, startUnit, nbUnits);
+#elif defined(STM32F1xx)
+    return calculatePages(startAddr, endAddr, startUnit, nbUnits);
+#endif
+}
+
+static void fillEraseInit(FLASH_EraseInitTypeDef &eraseInit, uint32_t startUnit, uint32_t nbUnits)
+{
+#if defined(STM32F4xx)
+    eraseInit.TypeErase = FLASH_TYPEERASE_SECTORS;
+    eraseInit.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+    eraseInit.Sector = startUnit;
+    eraseInit.NbSectors = nbUnits;
+#elif defined(STM32F1xx)
+    eraseInit.TypeErase = FLASH_TYPEERASE_PAGES;
+    eraseInit.PageAddress = FLASH_BASE + (startUnit * FLASH_PAGE_SIZE);
+    eraseInit.NbPages = nbUnits;
+#endif
+}
+
+// Program one word and verify it; flash must already be unlocked
+static bool programWord(uint32_t addr, uint32_t value)
 {
+    return flashProgram(addr, &value, 1) == 1;
+}
+
+bool FlashInterface::eraseApplication(EraseMode mode)
+{
+    appStatus_ = AppStatus::Unknown;
+
     // Critical protection check
-    if (appStart_ < APP_START_ADDRESS) {
+    if (appStart_ < APP_START_ADDRESS || eraseState_ == EraseState::Running) {
         return false;
     }
 
@@ -122,55 +208,224 @@ bool FlashInterface::eraseApplication()
     __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
 #endif
 
-    FLASH_EraseInitTypeDef eraseInit;
-    uint32_t sectorError = 0;
-    bool success = false;
+    journalReset();
 
-#if defined(STM32F4xx)
-    uint32_t startSector = 0, nbSectors = 0;
+    uint32_t startUnit = 0, nbUnits = 0;
+    bool success = false;
 
     // Ensure erase range includes CRC area
     uint32_t eraseEnd = (CRC_ADDRESS > appEnd_) ? CRC_ADDRESS : appEnd_;
 
-    if (calculateSectors(appStart_, eraseEnd, startSector, nbSectors)) {
-        eraseInit.TypeErase = FLASH_TYPEERASE_SECTORS;
-        eraseInit.VoltageRange = FLASH_VOLTAGE_RANGE_3;
-        eraseInit.Sector = startSector;
-        eraseInit.NbSectors = nbSectors;
-
-        if (HAL_FLASHEx_Erase(&eraseInit, &sectorError) == HAL_OK) {
+    for (uint32_t &bits : erasedUnits_)
+        bits = 0;
+
+    eraseState_ = EraseState::Idle;
+    eraseDone_ = 0;
+    eraseSkipped_ = 0;
+    eraseTotal_ = 0;
+
+    if (calculateUnits(appStart_, eraseEnd, startUnit, nbUnits)) {
+        if (mode == EraseMode::Background) {
+            // Stay unlocked, serviceErase() locks when the last unit is done
+            eraseFirst_ = startUnit;
+            eraseNext_ = startUnit + nbUnits - 1;
+            eraseTotal_ = nbUnits;
+            eraseInFlight_ = false;
+            eraseOnDemand_ = false;
+            eraseState_ = EraseState::Running;
+
+            HAL_NVIC_SetPriority(FLASH_IRQn, 0, 0);
+            HAL_NVIC_EnableIRQ(FLASH_IRQn);
+            return true;
+        } else if (mode == EraseMode::Full) {
+            eraseTotal_ = nbUnits;
             success = true;
+            for (uint32_t i = 0; success && i < nbUnits; i++)
+                success = eraseUnit(startUnit + i);
+        } else {
+            // Only invalidate the stored image now, application units follow the write pointer
+            eraseTotal_ = 1;
+            success = eraseUnit(addrToUnit(CRC_ADDRESS));
         }
     }
 
-#elif defined(STM32F1xx)
-    uint32_t startPage = 0, nbPages = 0;
+    HAL_FLASH_Lock();
 
-    uint32_t eraseEnd = (CRC_ADDRESS > appEnd_) ? CRC_ADDRESS : appEnd_;
+    if (success) {
+        flashAddress_ = appStart_;
+    }
+    eraseOnDemand_ = success && (mode == EraseMode::OnDemand);
+
+    return success;
+}
+
+EraseState FlashInterface::serviceErase()
+{
+    if (eraseState_ != EraseState::Running) {
+        return eraseState_;
+    }
 
-    if (calculatePages(appStart_, eraseEnd, startPage, nbPages)) {
-        eraseInit.TypeErase = FLASH_TYPEERASE_PAGES;
-        eraseInit.PageAddress = FLASH_BASE + (startPage * FLASH_PAGE_SIZE);
-        eraseInit.NbPages = nbPages;
+    if (eraseInFlight_) {
+        if (!eraseFinished_) {
+            return eraseState_;
+        }
 
-        if (HAL_FLASHEx_Erase(&eraseInit, &sectorError) == HAL_OK) {
-            success = true;
+        eraseInFlight_ = false;
+        if (!eraseOk_) {
+            eraseState_ = EraseState::Failed;
+            HAL_FLASH_Lock();
+            return eraseState_;
+        }
+
+        markErased(eraseNext_);
+        eraseDone_++;
+        if (!nextEraseUnit()) {
+            return eraseState_;
         }
     }
-#endif
 
-    HAL_FLASH_Lock();
+    // Already blank units are done without touching the flash controller
+    while (isBlank(unitAddress(eraseNext_), unitAddress(eraseNext_ + 1))) {
+        markErased(eraseNext_);
+        eraseDone_++;
+        eraseSkipped_++;
+        if (!nextEraseUnit()) {
+            return eraseState_;
+        }
+    }
 
-    if (success) {
+    // Highest unit first so the metadata is gone before any application sector
+    FLASH_EraseInitTypeDef eraseInit;
+    fillEraseInit(eraseInit, eraseNext_, 1);
+
+    eraseOk_ = true;
+    eraseFinished_ = false;
+    eraseInFlight_ = true;
+    if (HAL_FLASHEx_Erase_IT(&eraseInit) != HAL_OK) {
+        eraseInFlight_ = false;
+        eraseState_ = EraseState::Failed;
+        HAL_FLASH_Lock();
+    }
+
+    return eraseState_;
+}
+
+// Step the background erase down one unit, false once the region is complete
+bool FlashInterface::nextEraseUnit()
+{
+    if (eraseNext_ == eraseFirst_) {
+        eraseState_ = EraseState::Done;
         flashAddress_ = appStart_;
+        HAL_FLASH_Lock();
+        return false;
+    }
+
+    eraseNext_--;
+    return true;
+}
+
+void FlashInterface::onEraseComplete(bool ok)
+{
+    // An error may be followed by an end-of-operation callback, keep the failure
+    if (!ok) {
+        eraseOk_ = false;
     }
+    eraseFinished_ = true;
+}
+
+bool FlashInterface::ensureErased(uint32_t addr)
+{
+    if (!eraseOnDemand_) {
+        return true;
+    }
+
+    // Never erase below the application, nor past the units tracked in erasedUnits_
+    uint32_t unit = addrToUnit(addr);
+    if (addr < appStart_ || unit >= MAX_UNITS) {
+        return false;
+    }
+
+    if (isErased(unit)) {
+        return true;
+    }
+
+    eraseTotal_++;
+    return eraseUnit(unit);
+}
+
+// Erase one unit unless it is already blank; flash must be unlocked
+bool FlashInterface::eraseUnit(uint32_t unit)
+{
+    if (isBlank(unitAddress(unit), unitAddress(unit + 1))) {
+        eraseSkipped_++;
+    } else if (!flashErase(unit, unitAddress(unit), busyHook_)) {
+        return false;
+    }
+
+    markErased(unit);
+    eraseDone_++;
+    return true;
+}
+
+// Erase a single application sector/page for a partial update; the metadata goes too
+bool FlashInterface::eraseAppUnit(uint32_t index)
+{
+    appStatus_ = AppStatus::Unknown;
+
+    uint32_t startUnit = 0, nbUnits = 0;
+    if (appStart_ < APP_START_ADDRESS || eraseState_ == EraseState::Running ||
+        !calculateUnits(appStart_, appEnd_, startUnit, nbUnits) || index >= nbUnits) {
+        return false;
+    }
+
+    if (HAL_FLASH_Unlock() != HAL_OK) {
+        return false;
+    }
+
+    // Clear all error flags
+#if defined(STM32F1xx)
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_PGERR | FLASH_FLAG_WRPERR);
+#else
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+#endif
+
+    journalReset();
+
+    eraseState_ = EraseState::Idle;
+    eraseDone_ = 0;
+    eraseSkipped_ = 0;
+    eraseTotal_ = 2;
+
+    bool success = eraseUnit(addrToUnit(CRC_ADDRESS)) && eraseUnit(startUnit + index);
+
+    HAL_FLASH_Lock();
 
     return success;
 }
 
-bool FlashInterface::beginWrite()
+bool FlashInterface::beginWrite(uint16_t imageId, uint32_t length)
 {
+    appStatus_ = AppStatus::Unknown;
+
+    if (eraseState_ == EraseState::Running) {
+        return false;
+    }
+
     flashAddress_ = appStart_;
+    writtenEnd_ = appStart_;
+    resetStage();
+    for (uint32_t &bits : written_) {
+        bits = 0;
+    }
+    runningCrc_ = Crc32::INIT;
+    runningEnd_ = appStart_;
+    runningValid_ = true;
+
+    // Cycle counter for the programming statistics
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    programCycles_ = 0;
+    programWords_ = 0;
 
     if (HAL_FLASH_Unlock() != HAL_OK) {
         return false;
@@ -183,82 +438,436 @@ bool FlashInterface::beginWrite()
     __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
 #endif
 
+    // A new transfer of a known image starts from zero
+    journalId_ = imageId;
+    journalLength_ = length;
+    journalMark_ = JOURNAL_INTERVAL;
+    if (journalId_ != 0) {
+        journal_.append(journalId_, journalLength_, 0, busyHook_);
+    }
+
+    return true;
+}
+
+// Committed offset of the newest journal record for this image, false if there is none
+bool FlashInterface::resumePoint(uint16_t imageId, uint32_t &length, uint32_t &committed)
+{
+    JournalRecord record;
+    if (imageId == 0 || !journal_.last(record) || (record.header & 0xFFFF) != imageId) {
+        return false;
+    }
+
+    length = record.length;
+    committed = record.committed;
+    return committed <= appEnd_ - appStart_;
+}
+
+bool FlashInterface::resumeWrite(uint16_t imageId, uint32_t length)
+{
+    uint32_t journaled = 0, committed = 0;
+    if (!resumePoint(imageId, journaled, committed) || journaled != length) {
+        return false;
+    }
+
+    // Not journaled as a new transfer, that would reset the committed offset
+    if (!beginWrite()) {
+        return false;
+    }
+
+    // Everything below the committed offset is programmed; the unit it points into was erased
+    // for it, later units still hold whatever was there and are erased on demand
+    eraseOnDemand_ = true;
+    for (uint32_t &bits : erasedUnits_) {
+        bits = 0;
+    }
+    for (uint32_t addr = appStart_; addr < appStart_ + committed; addr = unitAddress(addrToUnit(addr) + 1)) {
+        markErased(addrToUnit(addr));
+    }
+
+    flashAddress_ = appStart_ + committed;
+    writtenEnd_ = flashAddress_;
+    resetStage();
+    markWritten(appStart_, committed / 4);
+
+    runningCrc_ = Crc32::update(Crc32::INIT, (const uint32_t *)appStart_, committed / 4);
+    runningEnd_ = flashAddress_;
+
+    journalId_ = imageId;
+    journalLength_ = length;
+    journalMark_ = committed + JOURNAL_INTERVAL;
     return true;
 }
 
+// Out of order and repeated words are fine, a bit is only ever set
+void FlashInterface::markWritten(uint32_t addr, uint32_t count)
+{
+    for (uint32_t word = (addr - appStart_) / 4; count > 0 && word < MAX_WORDS; count--, word++) {
+        written_[word / 32] |= 1UL << (word % 32);
+    }
+}
+
+uint32_t FlashInterface::blockCount() const
+{
+    uint32_t end = (journalLength_ != 0) ? journalLength_ : writtenEnd_ - appStart_;
+    uint32_t blocks = (end + WRITTEN_BLOCK_SIZE - 1) / WRITTEN_BLOCK_SIZE;
+    return (blocks < MAX_BLOCKS) ? blocks : MAX_BLOCKS;
+}
+
+// The last block of the image only needs the words up to the image end
+bool FlashInterface::blockWritten(uint32_t block) const
+{
+    if (block >= MAX_BLOCKS) {
+        return false;
+    }
+
+    uint32_t end = (journalLength_ != 0) ? journalLength_ : writtenEnd_ - appStart_;
+    uint32_t start = block * WRITTEN_BLOCK_SIZE;
+    uint32_t size = (end > start && end - start < WRITTEN_BLOCK_SIZE) ? end - start : WRITTEN_BLOCK_SIZE;
+    return rangeWritten(start, size);
+}
+
+// Checks up to 32 words per map word
+bool FlashInterface::rangeWritten(uint32_t offset, uint32_t size) const
+{
+    uint32_t word = offset / 4;
+    uint32_t end = (offset + size + 3) / 4;
+    if (end > MAX_WORDS) {
+        return false;
+    }
+
+    while (word < end) {
+        uint32_t bit = word % 32;
+        uint32_t n = (end - word < 32 - bit) ? end - word : 32 - bit;
+        uint32_t mask = (n == 32) ? 0xFFFFFFFF : ((1UL << n) - 1) << bit;
+        if ((written_[word / 32] & mask) != mask) {
+            return false;
+        }
+        word += n;
+    }
+    return true;
+}
+
+// Next run of missing blocks in [first, end), false if there is none
+bool FlashInterface::missingRange(uint32_t &first, uint32_t &count, uint32_t end) const
+{
+    while (first < end && blockWritten(first)) {
+        first++;
+    }
+
+    count = 0;
+    while (first + count < end && !blockWritten(first + count)) {
+        count++;
+    }
+    return count > 0;
+}
+
+bool FlashInterface::storedNodeId(uint8_t &nodeId)
+{
+    JournalRecord record;
+    if (!nodeLog_.last(record, JOURNAL_TAG_NODE)) {
+        return false;
+    }
+
+    nodeId = record.header & 0xFF;
+    return true;
+}
+
+// Kept in a log of its own, so neither an application erase nor a new image loses it
+bool FlashInterface::storeNodeId(uint8_t nodeId)
+{
+    uint8_t current;
+    if (storedNodeId(current) && current == nodeId) {
+        return true;
+    }
+
+    // Programming while HAL_FLASHEx_Erase_IT runs would fail with PGSERR
+    if (eraseState_ == EraseState::Running) {
+        return false;
+    }
+
+    // May arrive in the middle of a write session, leave the flash unlocked for it then
+    bool locked = (FLASH->CR & FLASH_CR_LOCK) != 0;
+    if (locked && HAL_FLASH_Unlock() != HAL_OK) {
+        return false;
+    }
+
+    bool ok = nodeLog_.append(nodeId, 0, 0, busyHook_, JOURNAL_TAG_NODE);
+
+    if (locked) {
+        HAL_FLASH_Lock();
+    }
+    return ok;
+}
+
+// Erased flash no longer holds the journaled progress
+void FlashInterface::journalReset()
+{
+    JournalRecord record;
+    if (journal_.last(record) && (record.header & 0xFFFF) != 0) {
+        journal_.append(0, 0, 0, busyHook_);
+    }
+    journalId_ = 0;
+}
+
+// Record the committed offset each time the contiguous image passes another interval
+void FlashInterface::journalProgress()
+{
+    uint32_t committed = runningEnd_ - appStart_;
+    if (journalId_ == 0 || !runningValid_ || committed < journalMark_) {
+        return;
+    }
+
+    committed -= committed % JOURNAL_INTERVAL;
+    journalMark_ = committed + JOURNAL_INTERVAL;
+    journal_.append(journalId_, journalLength_, committed, busyHook_);
+}
+
 bool FlashInterface::writeWord(uint32_t word)
 {
-    // Reserve last 4 bytes for application length
-    if (flashAddress_ >= appEnd_ - 4) {
+    // Direct writes land behind anything still staged
+    if (!flushStage()) {
         return false;
     }
 
+    return writeWords(&word, 1);
+}
+
+// Program a burst at the write pointer, which advances past every verified word
+bool FlashInterface::writeWords(const uint32_t *words, uint32_t count)
+{
+    appStatus_ = AppStatus::Unknown;
+
     // Check address alignment
     if (flashAddress_ & 0x3) {
         return false;
     }
 
-#if defined(STM32F1xx)
-    uint16_t halfWord1 = word & 0xFFFF;
-    uint16_t halfWord2 = (word >> 16) & 0xFFFF;
+    // The whole region is image, the length lives in the metadata unit
+    if (flashAddress_ > appEnd_ || count > (appEnd_ - flashAddress_) / 4) {
+        return false;
+    }
+
+    if (count == 0) {
+        return true;
+    }
+
+    // Erase on demand every sector/page the burst touches
+    uint32_t end = flashAddress_ + count * 4;
+    for (uint32_t addr = flashAddress_; addr < end; addr = unitAddress(addrToUnit(addr) + 1)) {
+        if (!ensureErased(addr)) {
+            return false;
+        }
+    }
+
+    uint32_t start = DWT->CYCCNT;
+    uint32_t done = flashProgram(flashAddress_, words, count);
+    programCycles_ += DWT->CYCCNT - start;
+    programWords_ += done;
+    markWritten(flashAddress_, done);
+
+    // Keep the image CRC current while the image is written front to back
+    if (runningValid_ && flashAddress_ == runningEnd_) {
+        runningCrc_ = Crc32::update(runningCrc_, words, done);
+        runningEnd_ += done * 4;
+        journalProgress();
+    } else if (flashAddress_ < runningEnd_) {
+        runningValid_ = false;
+    }
+
+    flashAddress_ += done * 4;
+    if (flashAddress_ > writtenEnd_) {
+        writtenEnd_ = flashAddress_;
+    }
+    return done == count;
+}
 
-    if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, flashAddress_, halfWord1) != HAL_OK) {
+// Write one word at an explicit offset, for repairs and out-of-order data; the write pointer stays put
+bool FlashInterface::writeAt(uint32_t offset, uint32_t word)
+{
+    if ((offset & 0x3) || offset >= appEnd_ - appStart_) {
         return false;
     }
 
-    if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, flashAddress_ + 2, halfWord2) != HAL_OK) {
+    // Staged words may cover the same address, they go first
+    if (!flushStage()) {
         return false;
     }
-#else
-    // Program word for F4
-    if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, flashAddress_, word) != HAL_OK) {
+
+    // A retransmission of a word that made it is not an error; before its on-demand erase
+    // the unit still holds the previous image, so equal contents mean nothing there
+    uint32_t addr = appStart_ + offset;
+    bool current = !eraseOnDemand_ || isErased(addrToUnit(addr));
+    if (current && *(volatile uint32_t *)addr == word) {
+        markWritten(addr, 1);
+        if (addr + 4 > writtenEnd_) {
+            writtenEnd_ = addr + 4;
+        }
+        return true;
+    }
+
+    uint32_t resume = flashAddress_;
+    flashAddress_ = addr;
+    bool ok = writeWords(&word, 1);
+    flashAddress_ = resume;
+    resetStage();
+
+    return ok;
+}
+
+bool FlashInterface::seek(uint32_t offset)
+{
+    if ((offset & 0x3) || offset >= appEnd_ - appStart_) {
         return false;
     }
-#endif
 
-    // Verify programming
-    uint32_t readback = *(volatile uint32_t *)flashAddress_;
-    if (readback != word) {
+    if (!flushStage()) {
         return false;
     }
 
-    flashAddress_ += 4;
+    flashAddress_ = appStart_ + offset;
+    resetStage();
     return true;
 }
 
-bool FlashInterface::endWrite()
+void FlashInterface::resetStage()
 {
-    // Store application length at the end of flash area
-    uint32_t appLength = flashAddress_ - appStart_;
+    stageCount_[0] = stageCount_[1] = 0;
+    stageDone_[0] = stageDone_[1] = 0;
+    fill_ = 0;
+    stageEnd_ = flashAddress_;
+}
 
-    // Check if we have space to store length
-    if (appEnd_ - appStart_ < 4) {
-        HAL_FLASH_Lock();
+// Free staging words: the rest of the filling buffer plus the other one once it is programmed
+uint32_t FlashInterface::stageSpace() const
+{
+    uint32_t space = STAGE_WORDS - stageCount_[fill_];
+    if (stageCount_[fill_ ^ 1] == 0) {
+        space += STAGE_WORDS;
+    }
+    return space;
+}
+
+// Copy words behind the staged data; all or nothing
+bool FlashInterface::stageWords(const uint32_t *words, uint32_t count)
+{
+    appStatus_ = AppStatus::Unknown;
+
+    if (stageEnd_ > appEnd_ || count > (appEnd_ - stageEnd_) / 4 || count > stageSpace()) {
         return false;
     }
 
-    uint32_t lengthAddress = appEnd_ - 4;
+    for (uint32_t i = 0; i < count; i++) {
+        stage_[fill_][stageCount_[fill_]++] = words[i];
+        swapStage();
+    }
 
-    // Program length
-#if defined(STM32F1xx)
-    uint16_t halfWord1 = appLength & 0xFFFF;
-    uint16_t halfWord2 = (appLength >> 16) & 0xFFFF;
+    stageEnd_ += count * 4;
+    return true;
+}
+
+// Hand a full buffer to serviceStage() as soon as the other one is free
+void FlashInterface::swapStage()
+{
+    if (stageCount_[fill_] == STAGE_WORDS && stageCount_[fill_ ^ 1] == 0) {
+        fill_ ^= 1;
+    }
+}
+
+// Program up to `words` more words of a buffer at the write pointer
+bool FlashInterface::programStage(uint8_t buffer, uint32_t words)
+{
+    uint32_t n = stageCount_[buffer] - stageDone_[buffer];
+    if (n > words) {
+        n = words;
+    }
+
+    if (!writeWords(&stage_[buffer][stageDone_[buffer]], n)) {
+        // Drop everything staged, the host resends from writeOffset()
+        resetStage();
+        return false;
+    }
+
+    stageDone_[buffer] += n;
+    if (stageDone_[buffer] == stageCount_[buffer]) {
+        stageCount_[buffer] = 0;
+        stageDone_[buffer] = 0;
+    }
+    return true;
+}
+
+bool FlashInterface::serviceStage()
+{
+    swapStage();
+
+    uint8_t full = fill_ ^ 1;
+    if (stageCount_[full] == 0) {
+        return true;
+    }
+
+    if (!programStage(full, STAGE_CHUNK_WORDS)) {
+        return false;
+    }
+
+    // Erase the next sector/page of the announced image ahead of the write pointer; without a
+    // length, or past the image end, units are only erased when the write pointer gets there
+    uint32_t next = unitAddress(addrToUnit(flashAddress_) + 1);
+    if (eraseOnDemand_ && journalLength_ != 0 && next < appStart_ + journalLength_ && next < appEnd_) {
+        ensureErased(next); // A failure shows up again when the write pointer gets there
+    }
+    return true;
+}
+
+bool FlashInterface::flushStage()
+{
+    uint8_t full = fill_ ^ 1;
+    if (stageCount_[full] != 0 && !programStage(full, STAGE_WORDS)) {
+        return false;
+    }
+
+    // The partly filled buffer goes last, the next words start a fresh one
+    if (stageCount_[fill_] != 0 && !programStage(fill_, STAGE_WORDS)) {
+        return false;
+    }
+
+    fill_ = 0;
+    return true;
+}
 
-    if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, lengthAddress, halfWord1) != HAL_OK) {
+bool FlashInterface::endWrite(uint32_t length)
+{
+    appStatus_ = AppStatus::Unknown;
+
+    if (!flushStage()) {
         HAL_FLASH_Lock();
         return false;
     }
 
-    if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, lengthAddress + 2, halfWord2) != HAL_OK) {
+    // Store application length next to the CRC, by default up to the highest word written
+    uint32_t appLength = (length != 0) ? length : writtenEnd_ - appStart_;
+
+    if (appLength > appEnd_ - appStart_ || (appLength & 0x3)) {
         HAL_FLASH_Lock();
         return false;
     }
-#else
-    if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, lengthAddress, appLength) != HAL_OK) {
+
+    // All data is in flash, a resume of this image only needs the end of write
+    if (journalId_ != 0) {
+        journal_.append(journalId_, journalLength_, appLength, busyHook_);
+    }
+
+    // Every erase mode clears the metadata unit, so an update never erases for the length word;
+    // writing the same length again (e.g. a repeated end of write) needs no programming
+    uint32_t lengthAddress = APP_LENGTH_ADDRESS;
+    if (*(volatile uint32_t *)lengthAddress == appLength) {
+        HAL_FLASH_Lock();
+        return true;
+    }
+
+    // Program length
+    if (!programWord(lengthAddress, appLength)) {
         HAL_FLASH_Lock();
         return false;
     }
-#endif
 
     // Strict multiple verification (before locking)
     uint32_t readback1 = *(volatile uint32_t *)lengthAddress;
@@ -274,10 +883,10 @@ bool FlashInterface::endWrite()
 
 uint32_t FlashInterface::getAppLength() const
 {
-    uint32_t len = *(volatile uint32_t *)(appEnd_ - 4);
+    uint32_t len = *(volatile uint32_t *)APP_LENGTH_ADDRESS;
 
     // Validate length
-    if (len == 0xFFFFFFFF || len > (appEnd_ - appStart_ - 4)) {
+    if (len == 0xFFFFFFFF || len > (appEnd_ - appStart_)) {
         return 0;
     }
 
@@ -286,32 +895,61 @@ uint32_t FlashInterface::getAppLength() const
 
 uint32_t FlashInterface::getAppCRC() const
 {
-    uint32_t crc = 0xFFFFFFFF;
     uint32_t len = getAppLength();
 
     if (len == 0 || len > (appEnd_ - appStart_)) {
         return 0xFFFFFFFF;
     }
 
-    // Calculate CRC32 for application data
-    for (uint32_t addr = appStart_; addr < appStart_ + len; addr += 4) {
-        uint32_t data = *(volatile uint32_t *)addr;
-        crc ^= data;
+    return getCRC(appStart_, len);
+}
 
-        for (int i = 0; i < 32; i++) {
-            if (crc & 1) {
-                crc = (crc >> 1) ^ 0xEDB88320;
-            } else {
-                crc >>= 1;
-            }
-        }
+// CRC of the stored image, O(1) when this session wrote it sequentially
+uint32_t FlashInterface::getWrittenCRC() const
+{
+    uint32_t len = getAppLength();
+
+    if (runningValid_ && len != 0 && runningEnd_ == appStart_ + len) {
+        return Crc32::finish(runningCrc_);
     }
 
-    return ~crc;
+    return getAppCRC();
+}
+
+uint32_t FlashInterface::getCRC(uint32_t start, uint32_t len) const
+{
+    // Calculate CRC32 over whole words with the engine selected by CRC32_ENGINE
+    return Crc32::compute((const uint32_t *)start, (len + 3) / 4);
+}
+
+uint32_t FlashInterface::appUnitCount() const
+{
+    uint32_t startUnit = 0, nbUnits = 0;
+    calculateUnits(appStart_, appEnd_, startUnit, nbUnits);
+    return nbUnits;
+}
+
+// Address range of the index-th application sector/page, clipped to the application region
+bool FlashInterface::appUnitRange(uint32_t index, uint32_t &start, uint32_t &size) const
+{
+    uint32_t startUnit = 0, nbUnits = 0;
+    if (!calculateUnits(appStart_, appEnd_, startUnit, nbUnits) || index >= nbUnits) {
+        return false;
+    }
+
+    start = unitAddress(startUnit + index);
+    uint32_t end = unitAddress(startUnit + index + 1);
+    if (start < appStart_) start = appStart_;
+    if (end > appEnd_) end = appEnd_;
+
+    size = end - start;
+    return true;
 }
 
 bool FlashInterface::writeCRC(uint32_t crc)
 {
+    appStatus_ = AppStatus::Unknown;
+
     if (HAL_FLASH_Unlock() != HAL_OK) {
         return false;
     }
@@ -324,25 +962,12 @@ bool FlashInterface::writeCRC(uint32_t crc)
     __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
 #endif
 
-    // Program CRC
-#if defined(STM32F1xx)
-    uint16_t halfWord1 = crc & 0xFFFF;
-    uint16_t halfWord2 = (crc >> 16) & 0xFFFF;
-
-    HAL_StatusTypeDef status1 = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, CRC_ADDRESS, halfWord1);
-    HAL_StatusTypeDef status2 = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, CRC_ADDRESS + 2, halfWord2);
-
-    HAL_StatusTypeDef status = (status1 == HAL_OK && status2 == HAL_OK) ? HAL_OK : HAL_ERROR;
-#else
-    HAL_StatusTypeDef status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, CRC_ADDRESS, crc);
-#endif
-
-    // Immediate read verification
-    uint32_t readback = *(volatile uint32_t *)CRC_ADDRESS;
+    // Program CRC, verified by read back
+    bool ok = programWord(CRC_ADDRESS, crc);
 
     HAL_FLASH_Lock();
 
-    return (status == HAL_OK) && (readback == crc);
+    return ok;
 }
 
 uint32_t FlashInterface::readCRC() const
@@ -363,31 +988,132 @@ bool FlashInterface::checkCRC() const
     return (crcCalc == crcStored);
 }
 
-bool FlashInterface::isAppValid() const
+bool FlashInterface::isAppValid()
 {
-    // 1. Check if CRC matches
-    if (!checkCRC()) {
-        return false;
+    return appStatus() == AppStatus::Valid;
+}
+
+// Cached verdict, recomputed only after erase/write/metadata changes
+AppStatus FlashInterface::appStatus()
+{
+    if (appStatus_ == AppStatus::Unknown) {
+        appStatus_ = evaluateApp();
+    }
+    return appStatus_;
+}
+
+AppStatus FlashInterface::evaluateApp()
+{
+    // 1. Handle case where CRC hasn't been written yet
+    if (readCRC() == 0xFFFFFFFF) {
+        return AppStatus::NoCRC;
     }
 
     // 2. Check if stack pointer is within valid RAM range
     uint32_t appStack = *(uint32_t *)APP_START_ADDRESS;
     if (appStack < RAM_START || appStack > (RAM_START + RAM_SIZE)) {
-        return false;
+        return AppStatus::BadStack;
     }
 
     // 3. Check if reset vector address is within Flash range
     uint32_t appEntry = *(uint32_t *)(APP_START_ADDRESS + 4);
     if (appEntry < APP_START_ADDRESS || appEntry >= (APP_START_ADDRESS + FLASH_SIZE)) {
-        return false;
+        return AppStatus::BadEntry;
     }
 
     // 4. Check if the first few words of application are all 0xFFFFFFFF (indicating unprogrammed)
+    bool blank = true;
     for (int i = 0; i < 8; i++) {
         if (*(uint32_t *)(APP_START_ADDRESS + i * 4) != 0xFFFFFFFF) {
-            return true; // At least some part is programmed
+            blank = false; // At least some part is programmed
+            break;
         }
     }
+    if (blank) {
+        return AppStatus::Blank; // First 32 bytes are all 0xFFFFFFFF, likely empty Flash
+    }
+
+    // 5. Fast boot: an image verified before whose header still hashes the same is trusted,
+    //    except on every FAST_BOOT_INTERVAL-th boot
+    uint32_t crcStored = readCRC();
+    bool fullCheck = true;
+    if (!bootCounted_) {
+        bootCounted_ = true;
+        fullCheck = countBoot();
+    }
+
+    if (!fullCheck && *(volatile uint32_t *)VERIFIED_ADDRESS == (VERIFIED_MAGIC ^ crcStored) &&
+        *(volatile uint32_t *)HEADER_CRC_ADDRESS == getHeaderCRC()) {
+        return AppStatus::Valid;
+    }
+
+    // 6. Full image CRC last, it is the expensive one
+    if (!checkCRC()) {
+        return AppStatus::CRCMismatch;
+    }
+
+    markVerified(crcStored);
+    return AppStatus::Valid;
+}
+
+uint32_t FlashInterface::getHeaderCRC() const
+{
+    uint32_t len = getAppLength();
+    if (len > FAST_BOOT_HEADER_SIZE) {
+        len = FAST_BOOT_HEADER_SIZE;
+    }
+
+    return getCRC(appStart_, len);
+}
+
+// Zero the next boot tally word, true if this boot needs the full CRC check
+bool FlashInterface::countBoot()
+{
+#if FAST_BOOT_INTERVAL == 0
+    return true;
+#else
+    const volatile uint32_t *tally = (const volatile uint32_t *)BOOT_TALLY_ADDRESS;
 
-    return false; // First 32 bytes are all 0xFFFFFFFF, likely empty Flash
-}
\ No newline at end of file
+    uint32_t used = 0;
+    while (used < BOOT_TALLY_WORDS && tally[used] == 0) {
+        used++;
+    }
+
+    // Tally full: every boot is a full check until the next update erases the metadata
+    if (used >= BOOT_TALLY_WORDS) {
+        return true;
+    }
+
+    if (HAL_FLASH_Unlock() != HAL_OK) {
+        return true;
+    }
+    bool ok = programWord(BOOT_TALLY_ADDRESS + used * 4, 0);
+    HAL_FLASH_Lock();
+
+    return !ok || ((used + 1) % FAST_BOOT_INTERVAL) == 0;
+#endif
+}
+
+// Record that the full CRC passed, so following boots can take the fast path
+bool FlashInterface::markVerified(uint32_t crc)
+{
+    uint32_t marker = VERIFIED_MAGIC ^ crc;
+    if (*(volatile uint32_t *)VERIFIED_ADDRESS == marker) {
+        return true;
+    }
+
+    // Written once per update, right after the metadata erase
+    if (*(volatile uint32_t *)VERIFIED_ADDRESS != 0xFFFFFFFF || *(volatile uint32_t *)HEADER_CRC_ADDRESS != 0xFFFFFFFF) {
+        return false;
+    }
+
+    if (HAL_FLASH_Unlock() != HAL_OK) {
+        return false;
+    }
+
+    // Header hash first, the marker makes it count
+    bool ok = programWord(HEADER_CRC_ADDRESS, getHeaderCRC()) && programWord(VERIFIED_ADDRESS, marker);
+
+    HAL_FLASH_Lock();
+    return ok;
+}
@@ -1,25 +1,163 @@
 #pragma once
 #include <cstdint>
+#include "Journal.h"
+
+enum class EraseMode : uint8_t {
+    Full = 0,       // Erase the whole application region up front
+    OnDemand = 1,   // Erase metadata now, each sector/page when the write pointer enters it
+    Background = 2, // Erase the whole region one sector/page at a time from serviceErase()
+};
+
+enum class EraseState : uint8_t {
+    Idle = 0,
+    Running = 1,
+    Done = 2,
+    Failed = 3,
+};
+
+// Why the stored application is (not) runnable
+enum class AppStatus : uint8_t {
+    Valid = 0,
+    NoCRC = 1,       // CRC never written (erased or unfinished update)
+    BadStack = 2,    // Initial stack pointer outside RAM
+    BadEntry = 3,    // Reset vector outside flash
+    Blank = 4,       // Vector table unprogrammed
+    CRCMismatch = 5, // Image does not match the stored CRC
+    Unknown = 0xFF,  // Not evaluated since the last flash change
+};
+
+#ifndef WRITTEN_BLOCK_SIZE
+#define WRITTEN_BLOCK_SIZE 256 // Granularity of the missing ranges report in bytes (multiple of 4)
+#endif
 
 class FlashInterface
 {
 public:
+#if defined(STM32F103xB)
+    static constexpr uint32_t MAX_BLOCKS = (60 * 1024) / WRITTEN_BLOCK_SIZE; // App region of the F103
+#else
+    static constexpr uint32_t MAX_BLOCKS = (736 * 1024) / WRITTEN_BLOCK_SIZE; // App region of the F412
+#endif
+    static constexpr uint32_t MAX_WORDS = MAX_BLOCKS * (WRITTEN_BLOCK_SIZE / 4);
+
+    static constexpr uint32_t STAGE_WORDS = 128;      // Words per staging buffer (512 bytes, two buffers)
+    static constexpr uint32_t STAGE_CHUNK_WORDS = 32; // Words programmed per serviceStage() call
+
     FlashInterface(uint32_t appStart, uint32_t appEnd);
+    void setBusyHook(void (*hook)()) { busyHook_ = hook; } // RAM function polled during erases
 
-    bool eraseApplication();
-    bool beginWrite();
+    bool eraseApplication(EraseMode mode = EraseMode::Full);
+    EraseState serviceErase(); // Advance a background erase, call from the main loop
+    void onEraseComplete(bool ok); // Called from the FLASH end-of-operation/error interrupt
+    EraseState eraseState() const { return eraseState_; }
+    uint32_t eraseDone() const { return eraseDone_; }
+    uint32_t eraseTotal() const { return eraseTotal_; }
+    uint32_t eraseSkipped() const { return eraseSkipped_; } // Units found blank and not erased
+    bool eraseAppUnit(uint32_t index);
+    bool beginWrite(uint16_t imageId = 0, uint32_t length = 0); // A non-zero image ID is journaled
+    bool resumeWrite(uint16_t imageId, uint32_t length);        // Continue at the journaled offset
+    bool resumePoint(uint16_t imageId, uint32_t &length, uint32_t &committed);
+    bool storedNodeId(uint8_t &nodeId); // Node ID assigned at runtime, false if none was stored
+    bool storeNodeId(uint8_t nodeId);
+    bool seek(uint32_t offset);
     bool writeWord(uint32_t word);
-    bool endWrite();
+    bool writeWords(const uint32_t *words, uint32_t count);
+    bool writeAt(uint32_t offset, uint32_t word);
+    uint32_t writeOffset() const { return flashAddress_ - appStart_; } // Programmed and verified
+    uint32_t readAt(uint32_t offset) const { return *(volatile uint32_t *)(appStart_ + offset); }
+
+    // Ping-pong staging: stream data is copied to RAM and programmed from serviceStage()
+    bool stageWords(const uint32_t *words, uint32_t count);
+    bool serviceStage(); // Program part of a full buffer, false once per programming failure
+    bool flushStage();   // Program everything staged
+    uint32_t stageSpace() const;
+    bool stageBusy() const { return stageCount_[fill_ ^ 1] != 0 || stageCount_[fill_] == STAGE_WORDS; }
+    uint32_t stagedOffset() const { return stageEnd_ - appStart_; } // Accepted into staging
+
+    // Written map: one bit per word, a WRITTEN_BLOCK_SIZE block is written once all its words are
+    uint32_t blockCount() const; // Blocks up to the announced image length (or the highest write)
+    bool blockWritten(uint32_t block) const;
+    bool rangeWritten(uint32_t offset, uint32_t size) const; // Every word of [offset, offset + size)
+    bool missingRange(uint32_t &first, uint32_t &count, uint32_t end) const;
+    uint32_t programCycles() const { return programCycles_; } // CPU cycles spent programming this session
+    uint32_t programWords() const { return programWords_; }
+    bool endWrite(uint32_t length = 0);
     uint32_t getAppCRC() const;
+    uint32_t getCRC(uint32_t start, uint32_t len) const;
+    uint32_t getWrittenCRC() const;
+
+    uint32_t appUnitCount() const;
+    bool appUnitRange(uint32_t index, uint32_t &start, uint32_t &size) const;
 
     bool writeCRC(uint32_t crc);
     uint32_t readCRC() const;
     bool checkCRC() const;
-    bool isAppValid() const;
+    bool isAppValid();
+    AppStatus appStatus();
     uint32_t getAppLength() const;
 
 private:
+    static constexpr uint32_t MAX_UNITS = 128; // Sectors (F4) or pages (F1) tracked per session
+
+    AppStatus evaluateApp();
+    uint32_t getHeaderCRC() const;
+    bool countBoot();
+    bool markVerified(uint32_t crc);
+    bool ensureErased(uint32_t addr);
+    bool eraseUnit(uint32_t unit);
+    bool nextEraseUnit();
+    bool isErased(uint32_t unit) const { return erasedUnits_[unit / 32] & (1UL << (unit % 32)); }
+    void markErased(uint32_t unit) { erasedUnits_[unit / 32] |= 1UL << (unit % 32); }
+    void resetStage();
+    void journalProgress();
+    void markWritten(uint32_t addr, uint32_t count);
+    void journalReset();
+    void swapStage();
+    bool programStage(uint8_t buffer, uint32_t words);
+
     uint32_t flashAddress_;
     uint32_t appStart_;
     uint32_t appEnd_;
+    uint32_t writtenEnd_; // Highest address written this session, the default image end
+    bool eraseOnDemand_ = false;
+    void (*busyHook_)() = nullptr;
+    AppStatus appStatus_ = AppStatus::Unknown;
+    bool bootCounted_ = false;
+    uint32_t erasedUnits_[MAX_UNITS / 32] = {};
+
+    // CRC register over [appStart_, runningEnd_), updated from verified readback
+    uint32_t runningCrc_ = 0xFFFFFFFF;
+    uint32_t runningEnd_ = 0;
+    bool runningValid_ = false;
+
+    // Staged words start at flashAddress_: the full buffer (fill_ ^ 1) first, then the one filling
+    uint32_t stage_[2][STAGE_WORDS];
+    uint32_t stageCount_[2] = {};
+    uint32_t stageDone_[2] = {};
+    uint8_t fill_ = 0;
+    uint32_t stageEnd_ = 0;
+
+    // Set for each word programmed (or found in place) this session, in any order
+    uint32_t written_[(MAX_WORDS + 31) / 32] = {};
+
+    // Progress of the journaled transfer, recorded every JOURNAL_INTERVAL bytes
+    Journal journal_;
+    Journal nodeLog_; // Assigned node ID
+    uint16_t journalId_ = 0;
+    uint32_t journalLength_ = 0;
+    uint32_t journalMark_ = 0;
+
+    uint32_t programCycles_ = 0;
+    uint32_t programWords_ = 0;
+
+    // Background erase walks units from eraseNext_ down to eraseFirst_
+    EraseState eraseState_ = EraseState::Idle;
+    uint32_t eraseFirst_ = 0;
+    uint32_t eraseNext_ = 0;
+    uint32_t eraseDone_ = 0;
+    uint32_t eraseSkipped_ = 0;
+    uint32_t eraseTotal_ = 0;
+    bool eraseInFlight_ = false;
+    volatile bool eraseFinished_ = false;
+    volatile bool eraseOk_ = false;
 };
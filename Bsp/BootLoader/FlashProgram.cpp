@@ -0,0 +1,170 @@
+// FlashProgram.cpp
+#include "FlashProgram.h"
+
+#if defined(STM32F4xx)
+#include "stm32f4xx_hal.h"
+#elif defined(STM32F1xx)
+#include "stm32f1xx_hal.h"
+#endif
+
+#if FLASH_PROGRAM_ENGINE == FLASH_PROGRAM_RAM
+
+#if defined(STM32F1xx)
+#define FLASH_PROGRAM_ERRORS (FLASH_SR_PGERR | FLASH_SR_WRPRTERR)
+#else
+#define FLASH_PROGRAM_ERRORS (FLASH_SR_OPERR | FLASH_SR_WRPERR | FLASH_SR_PGAERR | FLASH_SR_PGPERR | FLASH_SR_PGSERR)
+#endif
+
+// Copied to RAM by the startup code (.data), so the core keeps running while the flash is busy.
+// long_call: RAM is out of BL range from flash.
+__RAM_FUNC __attribute__((noinline, long_call)) static uint32_t programBurst(uint32_t addr, const uint32_t *words, uint32_t count)
+{
+    uint32_t done = 0;
+
+    FLASH->SR = FLASH_SR_EOP | FLASH_PROGRAM_ERRORS; // Write 1 to clear
+#if defined(STM32F1xx)
+    SET_BIT(FLASH->CR, FLASH_CR_PG);
+#else
+    MODIFY_REG(FLASH->CR, FLASH_CR_PSIZE, FLASH_PSIZE_WORD | FLASH_CR_PG);
+#endif
+
+    for (; done < count; done++, addr += 4) {
+        uint32_t word = words[done];
+
+#if defined(STM32F1xx)
+        // F1 programs half-words only
+        *(volatile uint16_t *)addr = (uint16_t)word;
+        while (FLASH->SR & FLASH_SR_BSY) {
+        }
+        *(volatile uint16_t *)(addr + 2) = (uint16_t)(word >> 16);
+#else
+        *(volatile uint32_t *)addr = word;
+#endif
+        while (FLASH->SR & FLASH_SR_BSY) {
+        }
+
+        if ((FLASH->SR & FLASH_PROGRAM_ERRORS) || *(volatile uint32_t *)addr != word) {
+            break;
+        }
+    }
+
+    CLEAR_BIT(FLASH->CR, FLASH_CR_PG);
+    return done;
+}
+
+uint32_t flashProgram(uint32_t addr, const uint32_t *words, uint32_t count)
+{
+    if (addr & 0x3) {
+        return 0;
+    }
+
+    return programBurst(addr, words, count);
+}
+
+// Interrupts stay masked until the flash is idle: the vector table and every handler live in the
+// flash being erased, a fetch from there would stall the core for the whole erase.
+__RAM_FUNC __attribute__((noinline, long_call)) static bool eraseBurst(uint32_t unit, uint32_t addr, void (*busyHook)())
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    FLASH->SR = FLASH_SR_EOP | FLASH_PROGRAM_ERRORS;
+#if defined(STM32F1xx)
+    SET_BIT(FLASH->CR, FLASH_CR_PER);
+    FLASH->AR = addr;
+#else
+    MODIFY_REG(FLASH->CR, FLASH_CR_PSIZE | FLASH_CR_SNB, FLASH_PSIZE_WORD | (unit << FLASH_CR_SNB_Pos) | FLASH_CR_SER);
+#endif
+    SET_BIT(FLASH->CR, FLASH_CR_STRT);
+    __DSB();
+
+    while (FLASH->SR & FLASH_SR_BSY) {
+        if (busyHook) {
+            busyHook();
+        }
+    }
+
+    bool ok = (FLASH->SR & FLASH_PROGRAM_ERRORS) == 0;
+#if defined(STM32F1xx)
+    CLEAR_BIT(FLASH->CR, FLASH_CR_PER);
+#else
+    CLEAR_BIT(FLASH->CR, FLASH_CR_SER | FLASH_CR_SNB);
+#endif
+
+    if (!primask) {
+        __enable_irq();
+    }
+    return ok;
+}
+
+bool flashErase(uint32_t unit, uint32_t addr, void (*busyHook)())
+{
+    bool ok = eraseBurst(unit, addr, busyHook);
+
+#if defined(STM32F4xx)
+    // The ART caches may still hold lines of the erased sector
+    if (FLASH->ACR & FLASH_ACR_ICEN) {
+        __HAL_FLASH_INSTRUCTION_CACHE_DISABLE();
+        __HAL_FLASH_INSTRUCTION_CACHE_RESET();
+        __HAL_FLASH_INSTRUCTION_CACHE_ENABLE();
+    }
+    if (FLASH->ACR & FLASH_ACR_DCEN) {
+        __HAL_FLASH_DATA_CACHE_DISABLE();
+        __HAL_FLASH_DATA_CACHE_RESET();
+        __HAL_FLASH_DATA_CACHE_ENABLE();
+    }
+#endif
+
+    return ok;
+}
+
+#else
+
+uint32_t flashProgram(uint32_t addr, const uint32_t *words, uint32_t count)
+{
+    if (addr & 0x3) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < count; i++, addr += 4) {
+#if defined(STM32F1xx)
+        if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, addr, words[i] & 0xFFFF) != HAL_OK ||
+            HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, addr + 2, (words[i] >> 16) & 0xFFFF) != HAL_OK) {
+            return i;
+        }
+#else
+        if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, addr, words[i]) != HAL_OK) {
+            return i;
+        }
+#endif
+
+        // Verify programming
+        if (*(volatile uint32_t *)addr != words[i]) {
+            return i;
+        }
+    }
+
+    return count;
+}
+
+// Blocking HAL erase from flash, busyHook is not called
+bool flashErase(uint32_t unit, uint32_t addr, void (*busyHook)())
+{
+    FLASH_EraseInitTypeDef eraseInit = {};
+    uint32_t error = 0;
+
+#if defined(STM32F1xx)
+    eraseInit.TypeErase = FLASH_TYPEERASE_PAGES;
+    eraseInit.PageAddress = addr;
+    eraseInit.NbPages = 1;
+#else
+    eraseInit.TypeErase = FLASH_TYPEERASE_SECTORS;
+    eraseInit.Sector = unit;
+    eraseInit.NbSectors = 1;
+    eraseInit.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+#endif
+
+    return HAL_FLASHEx_Erase(&eraseInit, &error) == HAL_OK;
+}
+
+#endif
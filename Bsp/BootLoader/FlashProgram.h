@@ -0,0 +1,22 @@
+// FlashProgram.h
+#pragma once
+#include <cstdint>
+
+// Word programming backend used by FlashInterface. Both keep the same semantics: program
+// `count` words from `words` at `addr` (4-byte aligned, flash unlocked, target erased) and
+// read every word back, stopping at the first flash error or mismatch.
+// Returns the number of words programmed and verified.
+#define FLASH_PROGRAM_HAL 0 // HAL_FLASH_Program per word, runs from flash
+#define FLASH_PROGRAM_RAM 1 // FLASH->CR/SR directly from a .RamFunc routine, one burst per call
+
+#ifndef FLASH_PROGRAM_ENGINE
+#define FLASH_PROGRAM_ENGINE FLASH_PROGRAM_RAM
+#endif
+
+uint32_t flashProgram(uint32_t addr, const uint32_t *words, uint32_t count);
+
+// Erase one sector (F4, `unit`) or page (F1, `addr`), flash unlocked. With the RAM engine the
+// core runs from RAM with interrupts masked until the flash is idle again and calls `busyHook`
+// (which must itself live in RAM) while waiting, so e.g. the CAN FIFO keeps being emptied;
+// the F4 ART caches are flushed afterwards. The HAL engine blocks in HAL_FLASHEx_Erase.
+bool flashErase(uint32_t unit, uint32_t addr, void (*busyHook)());
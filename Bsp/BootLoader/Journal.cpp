@@ -0,0 +1,68 @@
+// Journal.cpp
+#include "Journal.h"
+#include "Crc32.h"
+#include "FlashProgram.h"
+
+static bool isFree(const volatile uint32_t *slot)
+{
+    return (slot[0] & slot[1] & slot[2] & slot[3]) == 0xFFFFFFFF;
+}
+
+// Walk the log up to the first free slot; torn records (check mismatch) are skipped
+bool Journal::findFree(JournalRecord *newest, uint16_t tag)
+{
+    bool found = false;
+    uint32_t addr = start_;
+
+    for (; addr + sizeof(JournalRecord) <= end_; addr += sizeof(JournalRecord)) {
+        const volatile uint32_t *slot = (const volatile uint32_t *)addr;
+        if (isFree(slot)) {
+            break;
+        }
+
+        JournalRecord record = {slot[0], slot[1], slot[2], slot[3]};
+        if ((record.header >> 16) == tag && record.check == Crc32::compute(&record.header, 3)) {
+            if (newest) {
+                *newest = record;
+            }
+            found = true;
+        }
+    }
+
+    next_ = addr;
+    return found;
+}
+
+bool Journal::last(JournalRecord &record, uint16_t tag)
+{
+    return findFree(&record, tag);
+}
+
+bool Journal::append(uint16_t imageId, uint32_t length, uint32_t committed, void (*busyHook)(), uint16_t tag)
+{
+    if (next_ == 0) {
+        findFree(nullptr, tag);
+    }
+
+    if (next_ + sizeof(JournalRecord) > end_) {
+        if (!flashErase(unit_, start_, busyHook)) {
+            return false;
+        }
+        next_ = start_;
+    }
+
+    JournalRecord record;
+    record.header = ((uint32_t)tag << 16) | imageId;
+    record.length = length;
+    record.committed = committed;
+    record.check = Crc32::compute(&record.header, 3);
+    return program(record);
+}
+
+bool Journal::program(const JournalRecord &record)
+{
+    // Header first: a record torn by a power loss is never mistaken for a free slot
+    uint32_t addr = next_;
+    next_ += sizeof(JournalRecord);
+    return flashProgram(addr, &record.header, 4) == 4;
+}
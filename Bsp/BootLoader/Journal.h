@@ -0,0 +1,36 @@
+// Journal.h
+#pragma once
+#include <cstdint>
+
+#define JOURNAL_TAG      0x4A52U // "JR", upper half of JournalRecord::header for transfer progress
+#define JOURNAL_TAG_NODE 0x4E49U // "NI", assigned node ID in the lower half
+
+// Transfer progress and settings, appended to flash and never rewritten; per tag the newest valid record wins
+struct JournalRecord {
+    uint32_t header;    // Tag << 16 | image ID (node ID for JOURNAL_TAG_NODE)
+    uint32_t length;    // Expected image length
+    uint32_t committed; // Bytes programmed and verified contiguously from the image start
+    uint32_t check;     // CRC32 of the words above
+};
+
+// Append-only log in one sector/page. When it is full the unit is erased and the log starts
+// over with the record being appended; transfer progress and the node ID use separate logs,
+// so a wrap of one never takes the other with it.
+class Journal
+{
+public:
+    Journal(uint32_t start, uint32_t size, uint32_t unit) : start_(start), end_(start + size), unit_(unit) {}
+
+    bool last(JournalRecord &record, uint16_t tag = JOURNAL_TAG);
+    bool append(uint16_t imageId, uint32_t length, uint32_t committed, void (*busyHook)(), // Flash unlocked
+                uint16_t tag = JOURNAL_TAG);
+
+private:
+    bool findFree(JournalRecord *newest, uint16_t tag);
+    bool program(const JournalRecord &record);
+
+    uint32_t start_;
+    uint32_t end_;
+    uint32_t unit_;
+    uint32_t next_ = 0; // First free slot once scanned
+};
@@ -0,0 +1,84 @@
+// Lzss.cpp
+#include "Lzss.h"
+
+void LzssDecoder::reset()
+{
+    for (uint32_t i = 0; i < LZSS_WINDOW_SIZE; i++) {
+        window_[i] = 0;
+    }
+    head_ = 0;
+    state_ = State::Tag;
+    value_ = 0;
+    need_ = 1;
+    distance_ = 0;
+    word_ = 0;
+    wordBytes_ = 0;
+}
+
+void LzssDecoder::put(uint8_t byte, uint32_t *words, uint32_t &count)
+{
+    window_[head_++ & (LZSS_WINDOW_SIZE - 1)] = byte;
+
+    word_ |= (uint32_t)byte << (8 * wordBytes_);
+    if (++wordBytes_ == 4) {
+        words[count++] = word_;
+        word_ = 0;
+        wordBytes_ = 0;
+    }
+}
+
+// Symbols may span frames, the partial field is kept in value_/need_
+uint32_t LzssDecoder::decode(const uint8_t *in, uint32_t len, uint32_t words[LZSS_MAX_FRAME_WORDS])
+{
+    uint32_t count = 0;
+    if (len > 8) len = 8;
+
+    for (uint32_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            value_ = (value_ << 1) | ((in[i] >> bit) & 1);
+            if (--need_ != 0) {
+                continue;
+            }
+
+            switch (state_) {
+            case State::Tag:
+                state_ = value_ ? State::Literal : State::Distance;
+                need_ = value_ ? 8 : LZSS_WINDOW_BITS;
+                break;
+            case State::Literal:
+                put((uint8_t)value_, words, count);
+                state_ = State::Tag;
+                need_ = 1;
+                break;
+            case State::Distance:
+                distance_ = value_ + 1;
+                state_ = State::Length;
+                need_ = LZSS_LOOKAHEAD_BITS;
+                break;
+            case State::Length:
+                // Overlapping copies (distance < length) repeat the bytes just written, as intended
+                for (uint32_t n = 0; n <= value_; n++) {
+                    put(window_[(head_ - distance_) & (LZSS_WINDOW_SIZE - 1)], words, count);
+                }
+                state_ = State::Tag;
+                need_ = 1;
+                break;
+            }
+            value_ = 0;
+        }
+    }
+
+    return count;
+}
+
+bool LzssDecoder::flush(uint32_t &word)
+{
+    if (wordBytes_ == 0) {
+        return false;
+    }
+
+    word = word_ | (0xFFFFFFFFU << (8 * wordBytes_));
+    word_ = 0;
+    wordBytes_ = 0;
+    return true;
+}
@@ -0,0 +1,41 @@
+// Lzss.h
+#pragma once
+#include <cstdint>
+
+// Compressed stream: heatshrink LZSS bit stream (MSB first), as written by `heatshrink -e -w 8 -l 4`.
+// Tag bit 1: a literal byte follows. Tag bit 0: a back-reference follows, LZSS_WINDOW_BITS of
+// distance - 1, then LZSS_LOOKAHEAD_BITS of length - 1. The window starts out zero-filled.
+#define LZSS_WINDOW_BITS    8
+#define LZSS_LOOKAHEAD_BITS 4
+#define LZSS_WINDOW_SIZE    (1U << LZSS_WINDOW_BITS)
+
+// Worst case output of one 8-byte frame: 64 bits plus up to 12 bits of a symbol started in the
+// previous frame complete five 16-byte back-references, with 3 bytes of a word pending that is 20 words
+#define LZSS_MAX_FRAME_WORDS 20
+
+class LzssDecoder
+{
+public:
+    void reset();
+    uint32_t decode(const uint8_t *in, uint32_t len, uint32_t words[LZSS_MAX_FRAME_WORDS]); // Up to 8 bytes, returns words completed
+    bool flush(uint32_t &word); // Bytes of an unfinished last word padded with 0xFF, false if there are none
+
+private:
+    enum class State : uint8_t {
+        Tag,
+        Literal,
+        Distance,
+        Length,
+    };
+
+    void put(uint8_t byte, uint32_t *words, uint32_t &count);
+
+    uint8_t window_[LZSS_WINDOW_SIZE]; // Last decoded bytes, the back-reference source
+    uint32_t head_ = 0;
+    State state_ = State::Tag;
+    uint32_t value_ = 0;               // Bits of the current field so far
+    uint8_t need_ = 1;                 // Bits still missing in the current field
+    uint32_t distance_ = 0;
+    uint32_t word_ = 0;                // Output word being assembled, little endian
+    uint8_t wordBytes_ = 0;
+};
@@ -6,27 +6,85 @@ FlashInterface flash(APP_START_ADDRESS, APP_END_ADDRESS);
 CanInterface can(&hcan1, NODE_ID);
 Bootloader loader(flash, can);
 
+// Sits at BOOT_MAILBOX_ADDRESS, left untouched by the startup code (.noinit section in the linker script)
+__attribute__((section(BOOT_MAILBOX_SECTION), used)) BootMailbox bootMailbox;
+
+// Called from RAM while an erase stalls the flash
+__RAM_FUNC static void pollCanWhileFlashBusy()
+{
+    can.pollRxFifo0();
+}
+
 extern "C" void Main()
 {
+    // Consume the request so the next reset boots the application again
+    BootMailbox request;
+    bool stay = takeBootRequest(bootMailbox, request);
+
+    // A node ID assigned over the bus replaces the built-in NODE_ID
+    uint8_t nodeId;
+    if (flash.storedNodeId(nodeId)) {
+        can.setNodeId(nodeId);
+    }
+
     can.init();
+    flash.setBusyHook(pollCanWhileFlashBusy);
 
-    loader.run();
+    loader.run(stay ? &request : nullptr);
 
     while (1) {
     }
 }
 
+// Only queue frames here, commands are executed by Bootloader::run()
 extern "C" void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef *hcan)
 {
-    CAN_RxHeaderTypeDef rxHeader;
-    uint8_t rxData[8];
-    if (HAL_CAN_GetRxMessage(hcan, CAN_RX_FIFO0, &rxHeader, rxData) != HAL_OK) {
-        Error_Handler();
-    }
+    can.onRxFifo0Pending();
+}
 
-    uint8_t id = (rxHeader.StdId >> 7);
-    uint8_t cmd = (rxHeader.StdId & 0x7F);
+extern "C" void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef *hcan)
+{
+    can.onTxMailboxEmpty();
+}
+
+extern "C" void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef *hcan)
+{
+    can.onTxMailboxEmpty();
+}
+
+extern "C" void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef *hcan)
+{
+    can.onTxMailboxEmpty();
+}
 
-    if (id == NODE_ID)
-        loader.processCanCmd(id, cmd, rxData, rxHeader.DLC);
+extern "C" void HAL_CAN_TxMailbox0AbortCallback(CAN_HandleTypeDef *hcan)
+{
+    can.onTxMailboxEmpty();
+}
+
+extern "C" void HAL_CAN_TxMailbox1AbortCallback(CAN_HandleTypeDef *hcan)
+{
+    can.onTxMailboxEmpty();
+}
+
+extern "C" void HAL_CAN_TxMailbox2AbortCallback(CAN_HandleTypeDef *hcan)
+{
+    can.onTxMailboxEmpty();
+}
+
+// Transmit errors (lost arbitration, bus error) also free a mailbox
+extern "C" void HAL_CAN_ErrorCallback(CAN_HandleTypeDef *hcan)
+{
+    can.onTxMailboxEmpty();
+}
+
+// Background erase runs one sector/page per HAL_FLASHEx_Erase_IT call
+extern "C" void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue)
+{
+    flash.onEraseComplete(true);
+}
+
+extern "C" void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue)
+{
+    flash.onEraseComplete(false);
 }
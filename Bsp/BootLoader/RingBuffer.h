@@ -0,0 +1,76 @@
+// RingBuffer.h
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// Lock-free single-producer/single-consumer ring.
+// The producer may run in interrupt context, the consumer in the main loop (or vice versa).
+template <typename T, uint32_t Size>
+class RingBuffer
+{
+    static_assert(Size >= 2 && (Size & (Size - 1)) == 0, "Size must be a power of two");
+
+public:
+    // Producer side; always inlined so RAM-resident producers never call into flash
+    __attribute__((always_inline)) bool push(const T &item)
+    {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+
+        if (head - tail >= Size) {
+            overruns_ = overruns_ + 1;
+            return false;
+        }
+
+        buffer_[head & (Size - 1)] = item;
+        head_.store(head + 1, std::memory_order_release);
+
+        uint32_t level = head + 1 - tail;
+        if (level > highWater_) {
+            highWater_ = level;
+        }
+        return true;
+    }
+
+    // Consumer side
+    bool peek(T &item) const
+    {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        uint32_t head = head_.load(std::memory_order_acquire);
+
+        if (head == tail) {
+            return false;
+        }
+
+        item = buffer_[tail & (Size - 1)];
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        uint32_t head = head_.load(std::memory_order_acquire);
+
+        if (head == tail) {
+            return false;
+        }
+
+        item = buffer_[tail & (Size - 1)];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const { return size() == 0; }
+    uint32_t size() const { return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire); }
+    static constexpr uint32_t capacity() { return Size; }
+
+    uint32_t overruns() const { return overruns_; }   // Items rejected because the ring was full
+    uint32_t highWater() const { return highWater_; } // Deepest fill level seen
+
+private:
+    T buffer_[Size];
+    std::atomic<uint32_t> head_{0};
+    std::atomic<uint32_t> tail_{0};
+    volatile uint32_t overruns_ = 0;
+    volatile uint32_t highWater_ = 0;
+};
@@ -58,6 +58,7 @@ void SysTick_Handler(void);
 void CAN1_TX_IRQHandler(void);
 void CAN1_RX0_IRQHandler(void);
 /* USER CODE BEGIN EFP */
+void FLASH_IRQHandler(void);
 
 /* USER CODE END EFP */
 
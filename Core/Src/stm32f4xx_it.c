@@ -228,4 +228,12 @@ void CAN1_RX0_IRQHandler(void)
 
 /* USER CODE BEGIN 1 */
 
+/**
+  * @brief This function handles FLASH global interrupt (background erase).
+  */
+void FLASH_IRQHandler(void)
+{
+  HAL_FLASH_IRQHandler();
+}
+
 /* USER CODE END 1 */
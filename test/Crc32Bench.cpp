@@ -0,0 +1,77 @@
+// Crc32Bench.cpp
+#include "Crc32.h"
+#include "HostTest.h"
+#include <cstdint>
+#include <vector>
+
+// Application-sized image: code-like pseudo random words, a few tables and 0xFF padding at the end
+static std::vector<uint32_t> makeImage(uint32_t bytes)
+{
+    std::vector<uint32_t> image(bytes / 4, 0xFFFFFFFF);
+    uint32_t x = 0x12345678;
+    for (uint32_t i = 0; i < image.size() * 3 / 4; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        image[i] = (i % 64 < 8) ? i : x;
+    }
+    return image;
+}
+
+// Byte-wise reference, independent of the engines under test
+static uint32_t reference(const std::vector<uint32_t> &image)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (uint32_t word : image) {
+        for (int b = 0; b < 4; b++) {
+            crc ^= (word >> (8 * b)) & 0xFF;
+            for (int k = 0; k < 8; k++)
+                crc = (crc & 1) ? (crc >> 1) ^ CRC32_POLY : (crc >> 1);
+        }
+    }
+    return ~crc;
+}
+
+template <typename Engine>
+static int bench(const char *name, const std::vector<uint32_t> &image, uint32_t expected, uint32_t tableBytes)
+{
+    // Split in two calls to cover continuing a running register, as FlashInterface does
+    uint32_t half = image.size() / 2 + 1;
+    uint32_t crc = Engine::update(Crc32::INIT, image.data(), half);
+    crc = ~Engine::update(crc, image.data() + half, image.size() - half);
+    CHECK(crc == expected);
+
+    int rounds = 0;
+    auto start = std::chrono::steady_clock::now();
+    volatile uint32_t sink = 0;
+    do {
+        sink = sink + Engine::update(Crc32::INIT, image.data(), image.size());
+        rounds++;
+    } while (secondsSince(start) < 0.2);
+    double seconds = secondsSince(start) / rounds;
+
+    std::printf("crc32 %-8s table %5u B  %7.1f MB/s  %6.2f ns/word\n", name, tableBytes,
+                image.size() * 4 / seconds / 1e6, seconds * 1e9 / image.size());
+    return 0;
+}
+
+int main()
+{
+    // Known answer: CRC-32 of "12345678"
+    const uint32_t known[2] = {0x34333231, 0x38373635};
+    CHECK(~Crc32Slice8::update(Crc32::INIT, known, 2) == 0x9AE0DAAF);
+
+    std::vector<uint32_t> image = makeImage(736 * 1024);
+    uint32_t expected = reference(image);
+
+    if (bench<Crc32Bitwise>("bitwise", image, expected, 0) ||
+        bench<Crc32Table>("table", image, expected, sizeof(crc32Tables<1>)) ||
+        bench<Crc32Slice4>("slice4", image, expected, sizeof(crc32Tables<4>)) ||
+        bench<Crc32Slice8>("slice8", image, expected, sizeof(crc32Tables<8>))) {
+        return 1;
+    }
+
+    // The CRC unit engine needs the target; it is checked against these on the board via 0x05
+    std::printf("crc32: ok, host numbers only rank the engines; on the target the tables are read through flash wait states\n");
+    return 0;
+}
@@ -0,0 +1,160 @@
+// FecTest.cpp
+#include "Fec.h"
+#include "FlashInterface.h"
+#include "HostTest.h"
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static constexpr uint32_t BLOCK = FEC_SYMBOLS * FEC_SYMBOL_SIZE;
+
+// Host side encoder: repair[b] = XOR over j of c[j] * source[j][b]
+static void makeRepair(const uint8_t *block, uint8_t symbol, uint8_t out[FEC_SYMBOL_SIZE])
+{
+    uint8_t coef[FEC_SYMBOLS];
+    fecCoefficients(symbol, coef);
+    std::memset(out, 0, FEC_SYMBOL_SIZE);
+    for (uint32_t j = 0; j < FEC_SYMBOLS; j++)
+        for (uint32_t b = 0; b < FEC_SYMBOL_SIZE; b++)
+            out[b] ^= gfMul(coef[j], block[j * FEC_SYMBOL_SIZE + b]);
+}
+
+static std::vector<uint8_t> makeImage(uint32_t generations, std::mt19937 &rng)
+{
+    std::vector<uint8_t> image(generations * BLOCK);
+    for (uint8_t &byte : image)
+        byte = rng() & 0xFF;
+    return image;
+}
+
+// Generations that are not marked written or do not match the image
+static uint32_t countFailed(const FlashInterface &flash, const std::vector<uint8_t> &image, uint32_t generations)
+{
+    uint32_t failed = 0;
+    for (uint32_t g = 0; g < generations; g++) {
+        bool intact = flash.blockWritten(g);
+        for (uint32_t w = 0; intact && w < BLOCK; w += 4) {
+            uint32_t word;
+            std::memcpy(&word, &image[g * BLOCK + w], 4);
+            intact = flash.readAt(g * BLOCK + w) == word;
+        }
+        failed += !intact;
+    }
+    return failed;
+}
+
+// Send every generation with `lost` source symbols dropped and `repair` repair symbols, shuffled;
+// returns the generations that did not come out complete and intact
+static uint32_t run(uint32_t generations, uint32_t lost, uint32_t repair, uint32_t seed, double *secondsPerBlock)
+{
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> image = makeImage(generations, rng);
+
+    FlashInterface flash(generations * BLOCK);
+    FecDecoder decoder(flash);
+    decoder.reset();
+
+    struct Symbol {
+        uint32_t generation;
+        uint8_t symbol;
+        uint8_t data[FEC_SYMBOL_SIZE];
+    };
+    std::vector<Symbol> symbols;
+
+    for (uint32_t g = 0; g < generations; g++) {
+        std::vector<uint8_t> order(FEC_SYMBOLS);
+        for (uint32_t j = 0; j < FEC_SYMBOLS; j++)
+            order[j] = (uint8_t)j;
+        std::shuffle(order.begin(), order.end(), rng);
+
+        std::vector<Symbol> batch;
+        for (uint32_t j = lost; j < FEC_SYMBOLS; j++) {
+            Symbol s = {g, order[j], {}};
+            std::memcpy(s.data, &image[g * BLOCK + order[j] * FEC_SYMBOL_SIZE], FEC_SYMBOL_SIZE);
+            batch.push_back(s);
+        }
+        for (uint32_t r = 0; r < repair; r++) {
+            Symbol s = {g, (uint8_t)(FEC_SYMBOLS + r), {}};
+            makeRepair(&image[g * BLOCK], s.symbol, s.data);
+            batch.push_back(s);
+        }
+        std::shuffle(batch.begin(), batch.end(), rng);
+        symbols.insert(symbols.end(), batch.begin(), batch.end());
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (const Symbol &s : symbols) {
+        decoder.onSymbol(s.generation, s.symbol, s.data);
+    }
+    if (secondsPerBlock) {
+        *secondsPerBlock = secondsSince(start) / generations;
+    }
+    return countFailed(flash, image, generations);
+}
+
+// More generations in flight than FEC_WINDOW: half the source symbols of every generation go out
+// round robin, so each slot is evicted before it completes, then the rest follows one generation
+// at a time with only `lost` repair symbols, which is enough only if the evicted sources still count
+static uint32_t runEvicted(uint32_t generations, uint32_t lost, uint32_t seed)
+{
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> image = makeImage(generations, rng);
+
+    FlashInterface flash(generations * BLOCK);
+    FecDecoder decoder(flash);
+    decoder.reset();
+
+    std::vector<std::vector<uint8_t>> order(generations, std::vector<uint8_t>(FEC_SYMBOLS));
+    for (std::vector<uint8_t> &symbols : order) {
+        for (uint32_t j = 0; j < FEC_SYMBOLS; j++)
+            symbols[j] = (uint8_t)j;
+        std::shuffle(symbols.begin(), symbols.end(), rng);
+    }
+
+    for (uint32_t j = 0; j < FEC_SYMBOLS / 2; j++) {
+        for (uint32_t g = 0; g < generations; g++) {
+            decoder.onSymbol(g, order[g][j], &image[g * BLOCK + order[g][j] * FEC_SYMBOL_SIZE]);
+        }
+    }
+
+    for (uint32_t g = 0; g < generations; g++) {
+        for (uint32_t j = FEC_SYMBOLS / 2 + lost; j < FEC_SYMBOLS; j++) {
+            decoder.onSymbol(g, order[g][j], &image[g * BLOCK + order[g][j] * FEC_SYMBOL_SIZE]);
+        }
+        for (uint32_t r = 0; r < lost; r++) {
+            uint8_t data[FEC_SYMBOL_SIZE];
+            makeRepair(&image[g * BLOCK], (uint8_t)(FEC_SYMBOLS + r), data);
+            decoder.onSymbol(g, (uint8_t)(FEC_SYMBOLS + r), data);
+        }
+    }
+    return countFailed(flash, image, generations);
+}
+
+int main()
+{
+    // Any loss up to the number of repair symbols must be repaired, including the square case
+    for (uint32_t lost = 0; lost <= FEC_MAX_REPAIR; lost++) {
+        uint32_t failed = run(300, lost, FEC_MAX_REPAIR, 100 + lost, nullptr);
+        if (failed) {
+            std::printf("fec: %u lost, %u repair: %u of 300 generations not decoded\n", lost, FEC_MAX_REPAIR, failed);
+        }
+        CHECK(failed == 0);
+    }
+
+    // Interleaved generations evict each other; a reopened slot picks up the sources already in flash
+    for (uint32_t lost = 1; lost <= FEC_MAX_REPAIR; lost += 5) {
+        CHECK(runEvicted(3 * FEC_WINDOW, lost, 200 + lost) == 0);
+    }
+
+    // Too much loss leaves the generation to the missing ranges report, without corrupting it
+    CHECK(run(50, 12, 8, 7, nullptr) == 50);
+
+    double worst = 0, typical = 0;
+    CHECK(run(1000, FEC_MAX_REPAIR, FEC_MAX_REPAIR, 1, &worst) == 0);
+    CHECK(run(1000, 4, 8, 2, &typical) == 0);
+    std::printf("fec: decoder RAM %zu B, %.1f us per 256-byte block with 16 lost, %.1f us with 4 lost (host)\n",
+                sizeof(FecDecoder), worst * 1e6, typical * 1e6);
+    std::printf("fec: ok\n");
+    return 0;
+}
@@ -0,0 +1,18 @@
+// HostTest.h
+#pragma once
+#include <chrono>
+#include <cstdio>
+
+// Minimal checks for the host tests, no framework needed
+#define CHECK(cond)                                                            \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            return 1;                                                          \
+        }                                                                      \
+    } while (0)
+
+inline double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,192 @@
+// LzssBench.cpp
+#include "HostTest.h"
+#include "Lzss.h"
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Greedy encoder of the same bit stream (what `heatshrink -e -w 8 -l 4` produces, up to match choices)
+static std::vector<uint8_t> encode(const std::vector<uint8_t> &in)
+{
+    std::vector<uint8_t> window(LZSS_WINDOW_SIZE, 0); // Decoder starts zero-filled, matches may use it
+    std::vector<uint8_t> buf = window;
+    buf.insert(buf.end(), in.begin(), in.end());
+
+    std::vector<uint8_t> out;
+    uint32_t acc = 0, bits = 0;
+    auto emit = [&](uint32_t value, uint32_t count) {
+        for (int b = count - 1; b >= 0; b--) {
+            acc = (acc << 1) | ((value >> b) & 1);
+            if (++bits == 8) {
+                out.push_back((uint8_t)acc);
+                acc = bits = 0;
+            }
+        }
+    };
+
+    const uint32_t maxLength = 1U << LZSS_LOOKAHEAD_BITS;
+    for (size_t i = LZSS_WINDOW_SIZE; i < buf.size();) {
+        uint32_t best = 0, distance = 0;
+        for (uint32_t d = 1; d <= LZSS_WINDOW_SIZE && best < maxLength; d++) {
+            uint32_t n = 0;
+            while (n < maxLength && i + n < buf.size() && buf[i + n - d] == buf[i + n])
+                n++;
+            if (n > best) {
+                best = n;
+                distance = d;
+            }
+        }
+
+        if (best >= 2) {
+            emit(0, 1);
+            emit(distance - 1, LZSS_WINDOW_BITS);
+            emit(best - 1, LZSS_LOOKAHEAD_BITS);
+            i += best;
+        } else {
+            emit(1, 1);
+            emit(buf[i], 8);
+            i++;
+        }
+    }
+    if (bits) {
+        emit(0, 8 - bits);
+    }
+    return out;
+}
+
+// Firmware-like image: vector table, Thumb-ish code with recurring instruction pairs, literal pools,
+// string and lookup tables, zeroed init data and 0xFF padding up to the end of the last sector
+static std::vector<uint8_t> makeImage(uint32_t bytes)
+{
+    std::mt19937 rng(1);
+    std::vector<uint8_t> image;
+    auto put32 = [&](uint32_t w) {
+        for (int b = 0; b < 4; b++)
+            image.push_back((w >> (8 * b)) & 0xFF);
+    };
+
+    put32(0x20040000);
+    for (int i = 1; i < 98; i++)
+        put32((i < 16 || i % 3 == 0) ? 0x08008000 + 0x200 + i * 2 + 1 : 0x08008000 + 0x1C1);
+
+    static const uint16_t opcodes[] = {0xB580, 0xAF00, 0x4618, 0x6878, 0x687B, 0xF000, 0xBD80, 0x2300,
+                                       0x4B0A, 0x681B, 0x601A, 0x3301, 0x2B00, 0xD1F8, 0x4770, 0xE7FE};
+    const uint32_t codeEnd = bytes * 45 / 100;
+    while (image.size() < codeEnd) {
+        uint32_t run = 8 + rng() % 40;
+        for (uint32_t k = 0; k < run; k++) {
+            uint16_t op = (rng() % 4 == 0) ? (uint16_t)rng() : opcodes[rng() % 16];
+            image.push_back(op & 0xFF);
+            image.push_back(op >> 8);
+        }
+        for (uint32_t k = 0; k < 1 + rng() % 4; k++) {
+            static const uint32_t bases[] = {0x08008000, 0x20000000, 0x40000000, 0x40026400};
+            put32(bases[rng() % 4] + (rng() % 64) * 4);
+        }
+    }
+
+    const char *text = "CAN bootloader error: timeout waiting for frame\n";
+    while (image.size() < bytes * 55 / 100)
+        image.insert(image.end(), text, text + std::strlen(text));
+    for (uint32_t i = 0; image.size() < bytes * 62 / 100; i++)
+        put32(i * 0x1021 & 0xFFFF);
+    image.resize(bytes * 70 / 100, 0x00);
+    image.resize(bytes, 0xFF);
+    return image;
+}
+
+// Decode frame by frame like the 0x07 handler, check the per-frame bound and the output
+static uint64_t cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0; // No cycle counter, only ns/byte is reported
+#endif
+}
+
+struct DecodeTime {
+    double nsPerByte;
+    double cyclesPerByte; // Host TSC cycles
+};
+
+static int roundTrip(const std::vector<uint8_t> &image, const std::vector<uint8_t> &packed, DecodeTime *time)
+{
+    static LzssDecoder decoder;
+    std::vector<uint8_t> out;
+    out.reserve(image.size() + 4);
+    uint32_t words[LZSS_MAX_FRAME_WORDS];
+    uint32_t maxWords = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t startCycles = cycles();
+    decoder.reset();
+    for (size_t i = 0; i < packed.size(); i += 8) {
+        uint32_t count = decoder.decode(&packed[i], std::min<size_t>(8, packed.size() - i), words);
+        maxWords = std::max(maxWords, count);
+        for (uint32_t k = 0; k < count; k++)
+            for (int b = 0; b < 4; b++)
+                out.push_back((words[k] >> (8 * b)) & 0xFF);
+    }
+    uint32_t tail;
+    if (decoder.flush(tail)) {
+        for (int b = 0; b < 4; b++)
+            out.push_back((tail >> (8 * b)) & 0xFF);
+    }
+    if (time) {
+        time->cyclesPerByte = (double)(cycles() - startCycles) / image.size();
+        time->nsPerByte = secondsSince(start) * 1e9 / image.size();
+    }
+
+    CHECK(maxWords <= LZSS_MAX_FRAME_WORDS);
+    CHECK(out.size() >= image.size() && out.size() < image.size() + 4);
+    CHECK(std::equal(image.begin(), image.end(), out.begin()));
+    return 0;
+}
+
+static void report(const char *name, const std::vector<uint8_t> &image, const std::vector<uint8_t> &packed, const DecodeTime &time)
+{
+    // Raw stream frames carry 8 bytes; compressed frames too, so bus time scales with the size
+    std::printf("lzss %-10s %7zu -> %7zu bytes (%5.1f %%), %zu -> %zu frames, decode %.1f ns/byte %.1f cycles/byte (host)\n",
+                name, image.size(), packed.size(), 100.0 * packed.size() / image.size(), (image.size() + 7) / 8,
+                (packed.size() + 7) / 8, time.nsPerByte, time.cyclesPerByte);
+}
+
+int main(int argc, char **argv)
+{
+    // Worst case for the per-frame bound: long runs only ever need maximal back-references
+    std::vector<uint8_t> zeros(4096, 0);
+    CHECK(roundTrip(zeros, encode(zeros), nullptr) == 0);
+
+    std::mt19937 rng(3);
+    std::vector<uint8_t> noise(4096);
+    for (uint8_t &byte : noise)
+        byte = rng() & 0xFF;
+    std::vector<uint8_t> packed = encode(noise);
+    DecodeTime time{};
+    CHECK(roundTrip(noise, packed, &time) == 0);
+    report("random", noise, packed, time);
+
+    std::vector<uint8_t> image = makeImage(128 * 1024);
+    packed = encode(image);
+    CHECK(roundTrip(image, packed, &time) == 0);
+    report("synthetic", image, packed, time);
+
+    // Real images: lzss_bench app.bin [...]
+    for (int i = 1; i < argc; i++) {
+        std::ifstream file(argv[i], std::ios::binary);
+        std::vector<uint8_t> bin((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        bin.resize((bin.size() + 3) / 4 * 4, 0xFF);
+        packed = encode(bin);
+        CHECK(roundTrip(bin, packed, &time) == 0);
+        report(argv[i], bin, packed, time);
+    }
+
+    std::printf("lzss: ok\n");
+    return 0;
+}
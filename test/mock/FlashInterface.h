@@ -0,0 +1,45 @@
+// FlashInterface.h (host mock)
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#define WRITTEN_BLOCK_SIZE 256
+
+// The part of FlashInterface the FEC decoder uses: NOR semantics (bits only go 1 -> 0), words that
+// already hold the value are accepted, and a written map with one flag per word like the real one
+class FlashInterface
+{
+public:
+    explicit FlashInterface(uint32_t size) : mem_(size / 4, 0xFFFFFFFF), written_(size / 4, false) {}
+
+    bool writeAt(uint32_t offset, uint32_t word)
+    {
+        uint32_t &cell = mem_[offset / 4];
+        if ((cell & word) != word) {
+            return false;
+        }
+        cell = word;
+        written_[offset / 4] = true;
+        writes_++;
+        return true;
+    }
+
+    uint32_t readAt(uint32_t offset) const { return mem_[offset / 4]; }
+    bool blockWritten(uint32_t block) const { return rangeWritten(block * WRITTEN_BLOCK_SIZE, WRITTEN_BLOCK_SIZE); }
+
+    bool rangeWritten(uint32_t offset, uint32_t size) const
+    {
+        for (uint32_t w = offset / 4; w < (offset + size + 3) / 4; w++) {
+            if (w >= written_.size() || !written_[w]) {
+                return false;
+            }
+        }
+        return true;
+    }
+    uint32_t writes() const { return writes_; }
+
+private:
+    std::vector<uint32_t> mem_;
+    std::vector<bool> written_;
+    uint32_t writes_ = 0;
+};